@@ -0,0 +1,58 @@
+/*
+ * Copyright 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef _FBUTILS_BACKEND_H
+#define _FBUTILS_BACKEND_H
+
+#include <stdint.h>
+#include <linux/fb.h>
+
+/* What shows the picture fbutils-linux.c draws. Every backend describes
+ * its memory in fbdev terms: pixel format and size in var, the mapping in
+ * fix. Pages are stacked vertically, var.yoffset says which one is shown.
+ */
+struct fb_backend {
+	const char *name;
+	/* the memory shows what was on screen before, to be put back */
+	int8_t restore;
+
+	/* Fill in var and fix and map the memory to *mem. With double_buffer
+	 * set, there should be room for a second page, if possible, here or
+	 * in set_pages().
+	 */
+	int (*open)(struct fb_var_screeninfo *var, struct fb_fix_screeninfo *fix,
+		    unsigned char **mem);
+	/* Make room for a second page with nr 2, put back the mode open()
+	 * found with nr 1. Called with the screen saved, as a mode change can
+	 * wipe it. Updates var and fix and may move *mem, NULL if it is gone.
+	 * NULL if open() takes care of pages.
+	 */
+	int (*set_pages)(struct fb_var_screeninfo *var,
+			 struct fb_fix_screeninfo *fix, unsigned char **mem,
+			 int nr);
+	/* give back what open() took, put the original page back on screen */
+	void (*close)(unsigned char *mem);
+	/* show the page at var->yoffset, NULL if there is only one page */
+	int (*pan)(struct fb_var_screeninfo *var);
+	/* wait for the next vertical blank, NULL if it can't */
+	int (*wait_vsync)(void);
+	/* set palette entries, NULL for formats without palette */
+	int (*set_cmap)(struct fb_cmap *cmap);
+};
+
+/* fbutils-linux.c */
+int open_framebuffer_backend(const struct fb_backend *backend);
+
+/* fbutils-fbdev.c */
+extern const struct fb_backend fbdev_backend;
+
+/* fbutils-drm.c */
+extern const struct fb_backend drm_backend;
+
+/* fbutils-memory.c */
+extern const struct fb_backend memory_backend;
+
+#endif /* _FBUTILS_BACKEND_H */
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * Filling and copying large parts of the framebuffer. Once a fill is
+ * bigger than the caches, non-temporal stores save reading each line
+ * into the cache only to evict it again, and write combined video memory
+ * wants full lines anyway. On x86 AVX2 is used if the CPU has it.
+ */
+#include "config.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fbutils.h"
+
+#if !defined(LC_NO_SIMD) && defined(__SSE2__)
+# include <immintrin.h>
+# define HAVE_SSE2_BULK
+# if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_AVX2_BULK
+# endif
+#elif !defined(LC_NO_SIMD) && defined(__ARM_NEON)
+# include <arm_neon.h>
+# define HAVE_NEON_BULK
+#endif
+
+/* below this, ordinary stores that stay in the cache are faster */
+#define BULK_NT_MIN	(256 * 1024)
+/* the kernels go this many bytes at a time, from this alignment on */
+#define BULK_BLOCK	128
+#define BULK_ALIGN	32
+
+/* len is a multiple of BULK_BLOCK, dst is BULK_ALIGN aligned */
+static void fill_kernel_generic(uint8_t *dst, uint32_t pattern, size_t len)
+{
+	uint64_t v = pattern | ((uint64_t)pattern << 32);
+	uint64_t *d = (uint64_t *)dst;
+
+	for (len /= 8; len; len--)
+		*d++ = v;
+}
+
+static void copy_kernel_generic(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+#ifdef HAVE_SSE2_BULK
+static void fill_kernel_sse2(uint8_t *dst, uint32_t pattern, size_t len)
+{
+	const __m128i v = _mm_set1_epi32(pattern);
+	__m128i *d = (__m128i *)dst;
+
+	for (; len; len -= BULK_BLOCK, d += 8) {
+		_mm_stream_si128(d, v);
+		_mm_stream_si128(d + 1, v);
+		_mm_stream_si128(d + 2, v);
+		_mm_stream_si128(d + 3, v);
+		_mm_stream_si128(d + 4, v);
+		_mm_stream_si128(d + 5, v);
+		_mm_stream_si128(d + 6, v);
+		_mm_stream_si128(d + 7, v);
+	}
+	_mm_sfence();
+}
+
+static void copy_kernel_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const __m128i *s = (const __m128i *)src;
+	__m128i *d = (__m128i *)dst;
+	int i;
+
+	for (; len; len -= BULK_BLOCK, d += 8, s += 8)
+		for (i = 0; i < 8; i++)
+			_mm_stream_si128(d + i, _mm_loadu_si128(s + i));
+	_mm_sfence();
+}
+#endif
+
+#ifdef HAVE_AVX2_BULK
+__attribute__((target("avx2")))
+static void fill_kernel_avx2(uint8_t *dst, uint32_t pattern, size_t len)
+{
+	const __m256i v = _mm256_set1_epi32(pattern);
+	__m256i *d = (__m256i *)dst;
+
+	for (; len; len -= BULK_BLOCK, d += 4) {
+		_mm256_stream_si256(d, v);
+		_mm256_stream_si256(d + 1, v);
+		_mm256_stream_si256(d + 2, v);
+		_mm256_stream_si256(d + 3, v);
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void copy_kernel_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const __m256i *s = (const __m256i *)src;
+	__m256i *d = (__m256i *)dst;
+
+	for (; len; len -= BULK_BLOCK, d += 4, s += 4) {
+		_mm256_stream_si256(d, _mm256_loadu_si256(s));
+		_mm256_stream_si256(d + 1, _mm256_loadu_si256(s + 1));
+		_mm256_stream_si256(d + 2, _mm256_loadu_si256(s + 2));
+		_mm256_stream_si256(d + 3, _mm256_loadu_si256(s + 3));
+	}
+	_mm_sfence();
+}
+#endif
+
+#ifdef HAVE_NEON_BULK
+/* AArch64 has a non-temporal store pair, 32 bit ARM stores normally */
+static inline void __store_pair(uint8_t *d, uint8x16_t a, uint8x16_t b)
+{
+#ifdef __aarch64__
+	__asm__ volatile("stnp %q1, %q2, [%0]" : : "r"(d), "w"(a), "w"(b)
+			 : "memory");
+#else
+	vst1q_u8(d, a);
+	vst1q_u8(d + 16, b);
+#endif
+}
+
+static void fill_kernel_neon(uint8_t *dst, uint32_t pattern, size_t len)
+{
+	const uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(pattern));
+	int i;
+
+	for (; len; len -= BULK_BLOCK, dst += BULK_BLOCK)
+		for (i = 0; i < BULK_BLOCK; i += 32)
+			__store_pair(dst + i, v, v);
+}
+
+static void copy_kernel_neon(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	int i;
+
+	for (; len; len -= BULK_BLOCK, dst += BULK_BLOCK, src += BULK_BLOCK)
+		for (i = 0; i < BULK_BLOCK; i += 32)
+			__store_pair(dst + i, vld1q_u8(src + i),
+				     vld1q_u8(src + i + 16));
+}
+#endif
+
+static void (*fill_kernel)(uint8_t *dst, uint32_t pattern, size_t len);
+static void (*copy_kernel)(uint8_t *dst, const uint8_t *src, size_t len);
+/* render threads may come here first at the same time */
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void __select_kernels(void)
+{
+	void (*fill)(uint8_t *, uint32_t, size_t) = fill_kernel_generic;
+	void (*copy)(uint8_t *, const uint8_t *, size_t) = copy_kernel_generic;
+
+#if defined(HAVE_SSE2_BULK)
+	fill = fill_kernel_sse2;
+	copy = copy_kernel_sse2;
+#elif defined(HAVE_NEON_BULK)
+	fill = fill_kernel_neon;
+	copy = copy_kernel_neon;
+#endif
+#ifdef HAVE_AVX2_BULK
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fill = fill_kernel_avx2;
+		copy = copy_kernel_avx2;
+	}
+#endif
+
+	copy_kernel = copy;
+	fill_kernel = fill;
+}
+
+/* Fill len bytes at dst with the four bytes of pattern, as they are in
+ * memory, over and over. Pixels of 8, 16 and 32 bits repeat in there.
+ */
+void fill_bulk(void *dst, uint32_t pattern, size_t len)
+{
+	uint8_t *d = dst;
+	uint8_t p[4];
+	size_t head, body, i;
+
+	memcpy(p, &pattern, 4);
+	if (len < BULK_NT_MIN) {
+		if (p[0] == p[1] && p[0] == p[2] && p[0] == p[3]) {
+			memset(d, p[0], len);
+			return;
+		}
+		/* a few periods, then copies of what is there already */
+		for (i = 0; i < len && i < 64; i++)
+			d[i] = p[i & 3];
+		for (head = 64; head < len; head *= 2)
+			memcpy(d + head, d, head < len - head ? head : len - head);
+		return;
+	}
+
+	pthread_once(&kernels_once, __select_kernels);
+
+	head = -(uintptr_t)d & (BULK_ALIGN - 1);
+	for (i = 0; i < head; i++)
+		d[i] = p[i & 3];
+	d += head;
+	len -= head;
+
+	/* the pattern as it continues from the aligned start */
+	for (i = 0; i < 4; i++)
+		((uint8_t *)&pattern)[i] = p[(head + i) & 3];
+	body = len - len % BULK_BLOCK;
+	fill_kernel(d, pattern, body);
+
+	for (i = body; i < len; i++)
+		d[i] = p[(head + i) & 3];
+}
+
+/* memcpy() that doesn't go through the cache for large sizes */
+void copy_bulk(void *dst, const void *src, size_t len)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head, body;
+
+	if (len < BULK_NT_MIN) {
+		memcpy(d, s, len);
+		return;
+	}
+
+	pthread_once(&kernels_once, __select_kernels);
+
+	head = -(uintptr_t)d & (BULK_ALIGN - 1);
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+
+	body = len - len % BULK_BLOCK;
+	copy_kernel(d, s, body);
+	memcpy(d + body, s + body, len - body);
+}
@@ -0,0 +1,612 @@
+/*
+ * Copyright 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * Kernel mode setting, for systems without fbdev emulation. The picture is
+ * a dumb buffer, XRGB8888, on the first connected output in its preferred
+ * mode. With double_buffer it is two pages high, and showing the other
+ * page is a page flip, an atomic commit if the driver can do those. The
+ * flip completes on vertical blank, which is what wait_vsync waits for.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#ifdef HAVE_DRM_DRM_MODE_H
+# include <drm/drm.h>
+# include <drm/drm_mode.h>
+# include <drm/drm_fourcc.h>
+#else
+# include "drm-uapi.h"
+#endif
+
+#include "fbutils.h"
+#include "fbutils-backend.h"
+
+static char *defaultdrmdevice = "/dev/dri/card0";
+
+static int32_t drm_fd = -1;
+static uint32_t connector_id, crtc_id, crtc_index, plane_id;
+static struct drm_mode_modeinfo mode;
+static uint32_t mm_width, mm_height;
+/* what was on the CRTC before, to put back */
+static struct drm_mode_crtc saved_crtc;
+
+static uint32_t dumb_handle;
+static uint64_t dumb_size;
+static uint32_t fb_ids[2];
+static int32_t nr_fbs, shown_page;
+static int8_t flip_pending;
+
+/* property ids, if the driver does atomic mode setting */
+static int8_t atomic;
+static uint32_t mode_blob;
+static struct {
+	uint32_t connector_crtc_id;
+	uint32_t crtc_mode_id, crtc_active;
+	uint32_t fb_id, crtc_id, src_x, src_y, src_w, src_h;
+	uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+} prop;
+
+#define COMMIT_MAX_PROPS	16
+
+/* an atomic commit, properties grouped by object */
+struct commit {
+	uint32_t objs[3], counts[3];
+	uint32_t props[COMMIT_MAX_PROPS];
+	uint64_t values[COMMIT_MAX_PROPS];
+	uint32_t nr_objs, nr_props;
+};
+
+static void __commit_add(struct commit *c, uint32_t obj, uint32_t id,
+			 uint64_t value)
+{
+	if (c->nr_objs == 0 || c->objs[c->nr_objs - 1] != obj) {
+		c->objs[c->nr_objs] = obj;
+		c->counts[c->nr_objs++] = 0;
+	}
+	c->counts[c->nr_objs - 1]++;
+	c->props[c->nr_props] = id;
+	c->values[c->nr_props++] = value;
+}
+
+static int __commit(struct commit *c, uint32_t flags)
+{
+	struct drm_mode_atomic a;
+
+	memset(&a, 0, sizeof(a));
+	a.flags = flags;
+	a.count_objs = c->nr_objs;
+	a.objs_ptr = (uintptr_t)c->objs;
+	a.count_props_ptr = (uintptr_t)c->counts;
+	a.props_ptr = (uintptr_t)c->props;
+	a.prop_values_ptr = (uintptr_t)c->values;
+
+	return ioctl(drm_fd, DRM_IOCTL_MODE_ATOMIC, &a);
+}
+
+/* id of the property called name of an object, 0 if there is none */
+static uint32_t __property(uint32_t obj, uint32_t type, const char *name,
+			   uint64_t *value)
+{
+	struct drm_mode_obj_get_properties op;
+	struct drm_mode_get_property p;
+	uint32_t *ids = NULL, i, id = 0;
+	uint64_t *values = NULL;
+
+	memset(&op, 0, sizeof(op));
+	op.obj_id = obj;
+	op.obj_type = type;
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &op) < 0)
+		return 0;
+
+	ids = calloc(op.count_props, sizeof(*ids));
+	values = calloc(op.count_props, sizeof(*values));
+	if (!ids || !values)
+		goto out;
+	op.props_ptr = (uintptr_t)ids;
+	op.prop_values_ptr = (uintptr_t)values;
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &op) < 0)
+		goto out;
+
+	for (i = 0; i < op.count_props; i++) {
+		memset(&p, 0, sizeof(p));
+		p.prop_id = ids[i];
+		if (ioctl(drm_fd, DRM_IOCTL_MODE_GETPROPERTY, &p) < 0)
+			continue;
+		if (strncmp(p.name, name, DRM_PROP_NAME_LEN) == 0) {
+			id = ids[i];
+			if (value)
+				*value = values[i];
+			break;
+		}
+	}
+
+out:
+	free(ids);
+	free(values);
+	return id;
+}
+
+/* The first connected connector, its preferred mode and a CRTC for it */
+static int __find_output(void)
+{
+	struct drm_mode_card_res res;
+	struct drm_mode_get_connector conn;
+	struct drm_mode_get_encoder enc;
+	struct drm_mode_modeinfo *modes = NULL;
+	uint32_t *crtcs = NULL, *connectors = NULL, *encoders = NULL;
+	uint32_t nr_crtcs, nr_connectors, nr_modes, nr_encoders;
+	uint32_t i, j, k;
+	int ret = -1;
+
+	memset(&res, 0, sizeof(res));
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0) {
+		perror("DRM_IOCTL_MODE_GETRESOURCES");
+		return -1;
+	}
+
+	/* what is added between the two calls is left out */
+	nr_crtcs = res.count_crtcs;
+	nr_connectors = res.count_connectors;
+	crtcs = calloc(nr_crtcs + 1, sizeof(*crtcs));
+	connectors = calloc(nr_connectors + 1, sizeof(*connectors));
+	if (!crtcs || !connectors) {
+		perror("calloc");
+		goto out;
+	}
+	res.count_fbs = 0;
+	res.count_encoders = 0;
+	res.crtc_id_ptr = (uintptr_t)crtcs;
+	res.connector_id_ptr = (uintptr_t)connectors;
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_GETRESOURCES, &res) < 0) {
+		perror("DRM_IOCTL_MODE_GETRESOURCES");
+		goto out;
+	}
+
+	if (res.count_crtcs < nr_crtcs)
+		nr_crtcs = res.count_crtcs;
+	if (res.count_connectors < nr_connectors)
+		nr_connectors = res.count_connectors;
+
+	for (i = 0; i < nr_connectors && ret < 0; i++) {
+		memset(&conn, 0, sizeof(conn));
+		conn.connector_id = connectors[i];
+		if (ioctl(drm_fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) < 0 ||
+		    conn.connection != DRM_MODE_CONNECTED ||
+		    conn.count_modes == 0 || conn.count_encoders == 0)
+			continue;
+
+		free(modes);
+		free(encoders);
+		nr_modes = conn.count_modes;
+		nr_encoders = conn.count_encoders;
+		modes = calloc(nr_modes, sizeof(*modes));
+		encoders = calloc(nr_encoders, sizeof(*encoders));
+		if (!modes || !encoders) {
+			perror("calloc");
+			goto out;
+		}
+		conn.modes_ptr = (uintptr_t)modes;
+		conn.encoders_ptr = (uintptr_t)encoders;
+		conn.count_props = 0;
+		/* modes come all or none, changed in between means none */
+		if (ioctl(drm_fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) < 0 ||
+		    conn.count_modes != nr_modes ||
+		    conn.count_encoders != nr_encoders)
+			continue;
+
+		mode = modes[0];
+		for (j = 0; j < conn.count_modes; j++) {
+			if (modes[j].type & DRM_MODE_TYPE_PREFERRED) {
+				mode = modes[j];
+				break;
+			}
+		}
+
+		/* the CRTC it is on already, or any it can be on */
+		for (j = 0; j < conn.count_encoders && ret < 0; j++) {
+			memset(&enc, 0, sizeof(enc));
+			enc.encoder_id = encoders[j];
+			if (ioctl(drm_fd, DRM_IOCTL_MODE_GETENCODER, &enc) < 0)
+				continue;
+			for (k = 0; k < nr_crtcs; k++) {
+				if (enc.crtc_id ? crtcs[k] != enc.crtc_id :
+				    !(enc.possible_crtcs & (1 << k)))
+					continue;
+				connector_id = connectors[i];
+				mm_width = conn.mm_width;
+				mm_height = conn.mm_height;
+				crtc_id = crtcs[k];
+				crtc_index = k;
+				ret = 0;
+				break;
+			}
+		}
+	}
+
+	if (ret < 0)
+		fprintf(stderr, "No connected DRM output\n");
+
+out:
+	free(crtcs);
+	free(connectors);
+	free(modes);
+	free(encoders);
+	return ret;
+}
+
+/* The primary plane of our CRTC and all the properties a commit sets */
+static int __atomic_setup(void)
+{
+	struct drm_set_client_cap cap = { DRM_CLIENT_CAP_ATOMIC, 1 };
+	struct drm_mode_get_plane_res pres;
+	struct drm_mode_get_plane plane;
+	struct drm_mode_create_blob blob;
+	uint32_t *planes = NULL, i;
+	uint64_t type;
+
+	if (ioctl(drm_fd, DRM_IOCTL_SET_CLIENT_CAP, &cap) < 0)
+		return -1;
+
+	memset(&pres, 0, sizeof(pres));
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &pres) < 0)
+		goto err;
+	planes = calloc(pres.count_planes + 1, sizeof(*planes));
+	if (!planes)
+		goto err;
+	pres.plane_id_ptr = (uintptr_t)planes;
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &pres) < 0)
+		goto err;
+
+	plane_id = 0;
+	for (i = 0; i < pres.count_planes && !plane_id; i++) {
+		memset(&plane, 0, sizeof(plane));
+		plane.plane_id = planes[i];
+		if (ioctl(drm_fd, DRM_IOCTL_MODE_GETPLANE, &plane) < 0 ||
+		    !(plane.possible_crtcs & (1 << crtc_index)))
+			continue;
+		if (__property(planes[i], DRM_MODE_OBJECT_PLANE, "type",
+			       &type) && type == DRM_PLANE_TYPE_PRIMARY)
+			plane_id = planes[i];
+	}
+	free(planes);
+	planes = NULL;
+	if (!plane_id)
+		goto err;
+
+	prop.connector_crtc_id = __property(connector_id,
+					    DRM_MODE_OBJECT_CONNECTOR,
+					    "CRTC_ID", NULL);
+	prop.crtc_mode_id = __property(crtc_id, DRM_MODE_OBJECT_CRTC,
+				       "MODE_ID", NULL);
+	prop.crtc_active = __property(crtc_id, DRM_MODE_OBJECT_CRTC,
+				      "ACTIVE", NULL);
+#define PLANE_PROPERTY(field, name)					\
+	prop.field = __property(plane_id, DRM_MODE_OBJECT_PLANE, name, NULL)
+	PLANE_PROPERTY(fb_id, "FB_ID");
+	PLANE_PROPERTY(crtc_id, "CRTC_ID");
+	PLANE_PROPERTY(src_x, "SRC_X");
+	PLANE_PROPERTY(src_y, "SRC_Y");
+	PLANE_PROPERTY(src_w, "SRC_W");
+	PLANE_PROPERTY(src_h, "SRC_H");
+	PLANE_PROPERTY(crtc_x, "CRTC_X");
+	PLANE_PROPERTY(crtc_y, "CRTC_Y");
+	PLANE_PROPERTY(crtc_w, "CRTC_W");
+	PLANE_PROPERTY(crtc_h, "CRTC_H");
+#undef PLANE_PROPERTY
+	if (!prop.connector_crtc_id || !prop.crtc_mode_id ||
+	    !prop.crtc_active || !prop.fb_id || !prop.crtc_id ||
+	    !prop.src_x || !prop.src_y || !prop.src_w || !prop.src_h ||
+	    !prop.crtc_x || !prop.crtc_y || !prop.crtc_w || !prop.crtc_h)
+		goto err;
+
+	memset(&blob, 0, sizeof(blob));
+	blob.data = (uintptr_t)&mode;
+	blob.length = sizeof(mode);
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_CREATEPROPBLOB, &blob) < 0)
+		goto err;
+	mode_blob = blob.blob_id;
+
+	return 0;
+
+err:
+	free(planes);
+	cap.value = 0;
+	ioctl(drm_fd, DRM_IOCTL_SET_CLIENT_CAP, &cap);
+	return -1;
+}
+
+/* Light up the output with page 0 */
+static int __modeset(void)
+{
+	struct drm_mode_crtc crtc;
+	struct commit c;
+
+	if (atomic) {
+		memset(&c, 0, sizeof(c));
+		__commit_add(&c, connector_id, prop.connector_crtc_id, crtc_id);
+		__commit_add(&c, crtc_id, prop.crtc_mode_id, mode_blob);
+		__commit_add(&c, crtc_id, prop.crtc_active, 1);
+		__commit_add(&c, plane_id, prop.fb_id, fb_ids[0]);
+		__commit_add(&c, plane_id, prop.crtc_id, crtc_id);
+		/* source in 16.16 fixed point */
+		__commit_add(&c, plane_id, prop.src_x, 0);
+		__commit_add(&c, plane_id, prop.src_y, 0);
+		__commit_add(&c, plane_id, prop.src_w,
+			     (uint64_t)mode.hdisplay << 16);
+		__commit_add(&c, plane_id, prop.src_h,
+			     (uint64_t)mode.vdisplay << 16);
+		__commit_add(&c, plane_id, prop.crtc_x, 0);
+		__commit_add(&c, plane_id, prop.crtc_y, 0);
+		__commit_add(&c, plane_id, prop.crtc_w, mode.hdisplay);
+		__commit_add(&c, plane_id, prop.crtc_h, mode.vdisplay);
+		if (__commit(&c, DRM_MODE_ATOMIC_ALLOW_MODESET) == 0)
+			return 0;
+		perror("DRM_IOCTL_MODE_ATOMIC, legacy mode setting");
+		atomic = 0;
+	}
+
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = crtc_id;
+	crtc.fb_id = fb_ids[0];
+	crtc.set_connectors_ptr = (uintptr_t)&connector_id;
+	crtc.count_connectors = 1;
+	crtc.mode = mode;
+	crtc.mode_valid = 1;
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_SETCRTC, &crtc) < 0) {
+		perror("DRM_IOCTL_MODE_SETCRTC");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Read events until the page flip is done */
+static int __wait_flip(void)
+{
+	char buf[1024];
+	struct drm_event *e;
+	ssize_t len, i;
+
+	while (flip_pending) {
+		len = read(drm_fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			perror("read DRM event");
+			flip_pending = 0;
+			return -1;
+		}
+
+		for (i = 0; i + (ssize_t)sizeof(*e) <= len; i += e->length) {
+			e = (struct drm_event *)(buf + i);
+			if (e->length < sizeof(*e))
+				break;
+			if (e->type == DRM_EVENT_FLIP_COMPLETE)
+				flip_pending = 0;
+		}
+	}
+
+	return 0;
+}
+
+static void __free_buffers(unsigned char *mem)
+{
+	struct drm_mode_destroy_dumb destroy;
+	struct drm_mode_destroy_blob blob;
+
+	while (nr_fbs > 0)
+		ioctl(drm_fd, DRM_IOCTL_MODE_RMFB, &fb_ids[--nr_fbs]);
+
+	if (mode_blob) {
+		blob.blob_id = mode_blob;
+		ioctl(drm_fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &blob);
+		mode_blob = 0;
+	}
+
+	if (mem)
+		munmap(mem, dumb_size);
+
+	if (dumb_handle) {
+		destroy.handle = dumb_handle;
+		ioctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+		dumb_handle = 0;
+	}
+
+	close(drm_fd);
+	drm_fd = -1;
+}
+
+static int drm_open(struct fb_var_screeninfo *var,
+		    struct fb_fix_screeninfo *fix, unsigned char **mem)
+{
+	struct drm_get_cap cap = { DRM_CAP_DUMB_BUFFER, 0 };
+	struct drm_mode_create_dumb create;
+	struct drm_mode_map_dumb map;
+	struct drm_mode_fb_cmd2 fb;
+	char *drmdevice;
+	int32_t pages = double_buffer ? 2 : 1;
+
+	if ((drmdevice = getenv("LC_DRMDEVICE")) == NULL)
+		drmdevice = defaultdrmdevice;
+
+	*mem = NULL;
+	drm_fd = open(drmdevice, O_RDWR | O_CLOEXEC);
+	if (drm_fd < 0) {
+		perror("open drmdevice");
+		return -1;
+	}
+
+	if (ioctl(drm_fd, DRM_IOCTL_GET_CAP, &cap) < 0 || !cap.value) {
+		fprintf(stderr, "%s has no dumb buffers\n", drmdevice);
+		goto err;
+	}
+
+	if (__find_output() < 0)
+		goto err;
+
+	memset(&saved_crtc, 0, sizeof(saved_crtc));
+	saved_crtc.crtc_id = crtc_id;
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_GETCRTC, &saved_crtc) < 0)
+		saved_crtc.mode_valid = 0;
+
+	/* pages below each other, like fbdev pans */
+	memset(&create, 0, sizeof(create));
+	create.width = mode.hdisplay;
+	create.height = mode.vdisplay * pages;
+	create.bpp = 32;
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+		perror("DRM_IOCTL_MODE_CREATE_DUMB");
+		goto err;
+	}
+	dumb_handle = create.handle;
+	dumb_size = create.size;
+
+	for (nr_fbs = 0; nr_fbs < pages; nr_fbs++) {
+		memset(&fb, 0, sizeof(fb));
+		fb.width = mode.hdisplay;
+		fb.height = mode.vdisplay;
+		fb.pixel_format = DRM_FORMAT_XRGB8888;
+		fb.handles[0] = create.handle;
+		fb.pitches[0] = create.pitch;
+		fb.offsets[0] = nr_fbs * create.pitch * mode.vdisplay;
+		if (ioctl(drm_fd, DRM_IOCTL_MODE_ADDFB2, &fb) < 0) {
+			perror("DRM_IOCTL_MODE_ADDFB2");
+			if (nr_fbs == 0)
+				goto err;
+			/* one page is enough */
+			create.height = mode.vdisplay;
+			break;
+		}
+		fb_ids[nr_fbs] = fb.fb_id;
+	}
+
+	memset(&map, 0, sizeof(map));
+	map.handle = create.handle;
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+		perror("DRM_IOCTL_MODE_MAP_DUMB");
+		goto err;
+	}
+	*mem = mmap(NULL, dumb_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    drm_fd, map.offset);
+	if (*mem == MAP_FAILED) {
+		perror("mmap dumb buffer");
+		*mem = NULL;
+		goto err;
+	}
+
+	atomic = __atomic_setup() == 0;
+	if (__modeset() < 0)
+		goto err;
+	shown_page = 0;
+	flip_pending = 0;
+
+	memset(fix, 0, sizeof(*fix));
+	memset(var, 0, sizeof(*var));
+	strcpy(fix->id, "drm");
+	fix->visual = FB_VISUAL_TRUECOLOR;
+	fix->line_length = create.pitch;
+	fix->smem_len = create.pitch * create.height;
+	var->xres = var->xres_virtual = mode.hdisplay;
+	var->yres = mode.vdisplay;
+	var->yres_virtual = create.height;
+	var->bits_per_pixel = 32;
+	var->red.offset = 16;
+	var->red.length = 8;
+	var->green.offset = 8;
+	var->green.length = 8;
+	var->blue.length = 8;
+	/* for the size of text */
+	var->width = mm_width;
+	var->height = mm_height;
+
+	return 0;
+
+err:
+	__free_buffers(*mem);
+	*mem = NULL;
+	return -1;
+}
+
+static void drm_close(unsigned char *mem)
+{
+	struct drm_mode_crtc crtc;
+
+	__wait_flip();
+
+	/* what was there before, or nothing */
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = crtc_id;
+	if (saved_crtc.mode_valid && saved_crtc.fb_id) {
+		crtc = saved_crtc;
+		crtc.set_connectors_ptr = (uintptr_t)&connector_id;
+		crtc.count_connectors = 1;
+	}
+	if (ioctl(drm_fd, DRM_IOCTL_MODE_SETCRTC, &crtc) < 0)
+		perror("DRM_IOCTL_MODE_SETCRTC");
+
+	__free_buffers(mem);
+}
+
+/* flip to the page at var->yoffset, done at the next vertical blank */
+static int drm_pan(struct fb_var_screeninfo *var)
+{
+	struct drm_mode_crtc_page_flip flip;
+	struct commit c;
+	int32_t page = var->yoffset / var->yres;
+	int ret;
+
+	if (page == shown_page)
+		return 0;
+	if (page >= nr_fbs) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* only one flip at a time */
+	if (__wait_flip() < 0)
+		return -1;
+
+	if (atomic) {
+		memset(&c, 0, sizeof(c));
+		__commit_add(&c, plane_id, prop.fb_id, fb_ids[page]);
+		ret = __commit(&c, DRM_MODE_ATOMIC_NONBLOCK |
+				   DRM_MODE_PAGE_FLIP_EVENT);
+	} else {
+		memset(&flip, 0, sizeof(flip));
+		flip.crtc_id = crtc_id;
+		flip.fb_id = fb_ids[page];
+		flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+		ret = ioctl(drm_fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+	}
+	if (ret < 0)
+		return -1;
+
+	flip_pending = 1;
+	shown_page = page;
+
+	return 0;
+}
+
+static int drm_wait_vsync(void)
+{
+	return __wait_flip();
+}
+
+const struct fb_backend drm_backend = {
+	.name = "drm",
+	.open = drm_open,
+	.close = drm_close,
+	.pan = drm_pan,
+	.wait_vsync = drm_wait_vsync,
+};
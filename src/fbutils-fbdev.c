@@ -0,0 +1,299 @@
+/*
+ * Copyright 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * The Linux framebuffer device, on a virtual terminal of its own in
+ * graphics mode.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include <linux/vt.h>
+#include <linux/kd.h>
+#include <linux/fb.h>
+
+#include "fbutils.h"
+#include "fbutils-backend.h"
+
+static int32_t con_fd, last_vt = -1;
+static int32_t fb_fd = -1;
+static uint32_t smem_len;
+static struct fb_var_screeninfo *cur_var;
+/* the mode as it was, and whether set_pages() changed it */
+static struct fb_var_screeninfo orig_var;
+static int8_t var_changed;
+
+/* the console's palette, for 8 bit visuals that have one */
+static uint16_t saved_red[256], saved_green[256], saved_blue[256];
+static struct fb_cmap saved_cmap = {
+	.len = 256,
+	.red = saved_red,
+	.green = saved_green,
+	.blue = saved_blue,
+};
+static int8_t have_saved_cmap;
+
+static char *defaultfbdevice = "/dev/fb0";
+static char *defaultconsoledevice = "/dev/tty";
+static char *fbdevice;
+static char *consoledevice;
+
+#define VTNAME_LEN 128
+
+/* Map the framebuffer again after a mode change, which can move it */
+static int __remap(struct fb_var_screeninfo *var,
+		   struct fb_fix_screeninfo *fix, unsigned char **mem)
+{
+	if (ioctl(fb_fd, FBIOGET_VSCREENINFO, var) < 0 ||
+	    ioctl(fb_fd, FBIOGET_FSCREENINFO, fix) < 0)
+		perror("ioctl FBIOGET_*SCREENINFO");
+
+	if (*mem)
+		munmap(*mem, smem_len);
+	*mem = mmap(NULL, fix->smem_len, PROT_READ | PROT_WRITE,
+		    MAP_FILE | MAP_SHARED, fb_fd, 0);
+	if (*mem == (unsigned char *)-1) {
+		perror("mmap framebuffer");
+		*mem = NULL;
+		smem_len = 0;
+		return -1;
+	}
+	smem_len = fix->smem_len;
+
+	return 0;
+}
+
+/* the mode open() found, if set_pages() changed it */
+static int __restore_var(struct fb_var_screeninfo *var,
+			 struct fb_fix_screeninfo *fix, unsigned char **mem)
+{
+	struct fb_var_screeninfo v = orig_var;
+
+	if (!var_changed)
+		return 0;
+
+	var_changed = 0;
+	if (ioctl(fb_fd, FBIOPUT_VSCREENINFO, &v) < 0)
+		perror("ioctl FBIOPUT_VSCREENINFO");
+
+	return __remap(var, fix, mem);
+}
+
+/* A second page below the visible one, if there isn't one yet. Whether
+ * it worked shows in var and fix.
+ */
+static int fbdev_set_pages(struct fb_var_screeninfo *var,
+			   struct fb_fix_screeninfo *fix, unsigned char **mem,
+			   int nr)
+{
+	struct fb_var_screeninfo v = *var;
+
+	if (nr == 1)
+		return __restore_var(var, fix, mem);
+
+	if (var->yres_virtual >= 2 * var->yres)
+		return 0;
+
+	v.yres_virtual = 2 * var->yres;
+	if (ioctl(fb_fd, FBIOPUT_VSCREENINFO, &v) < 0)
+		return -1;
+	var_changed = 1;
+
+	if (__remap(var, fix, mem) < 0) {
+		/* one page it is, where it was */
+		__restore_var(var, fix, mem);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void __leave_vt(void)
+{
+	if (strcmp(consoledevice, "none") == 0)
+		return;
+
+	if (ioctl(con_fd, KDSETMODE, KD_TEXT) < 0)
+		perror("KDSETMODE");
+
+	if (last_vt >= 0)
+		if (ioctl(con_fd, VT_ACTIVATE, last_vt))
+			perror("VT_ACTIVATE");
+
+	close(con_fd);
+}
+
+static int fbdev_open(struct fb_var_screeninfo *var,
+		      struct fb_fix_screeninfo *fix, unsigned char **mem)
+{
+	struct vt_stat vts;
+	char vtname[VTNAME_LEN];
+	int32_t fd, nr;
+
+	if ((fbdevice = getenv("TSLIB_FBDEVICE")) == NULL)
+		fbdevice = defaultfbdevice;
+
+	if ((consoledevice = getenv("TSLIB_CONSOLEDEVICE")) == NULL)
+		consoledevice = defaultconsoledevice;
+
+	if (strcmp(consoledevice, "none") != 0) {
+		if (strlen(consoledevice) >= VTNAME_LEN)
+			return -1;
+
+		sprintf(vtname, "%s%d", consoledevice, 1);
+		fd = open(vtname, O_WRONLY);
+		if (fd < 0) {
+			perror("open consoledevice");
+			return -1;
+		}
+
+		if (ioctl(fd, VT_OPENQRY, &nr) < 0) {
+			close(fd);
+			perror("ioctl VT_OPENQRY");
+			return -1;
+		}
+		close(fd);
+
+		sprintf(vtname, "%s%d", consoledevice, nr);
+
+		con_fd = open(vtname, O_RDWR | O_NDELAY);
+		if (con_fd < 0) {
+			perror("open tty");
+			return -1;
+		}
+
+		if (ioctl(con_fd, VT_GETSTATE, &vts) == 0)
+			last_vt = vts.v_active;
+
+		if (ioctl(con_fd, VT_ACTIVATE, nr) < 0) {
+			perror("VT_ACTIVATE");
+			close(con_fd);
+			return -1;
+		}
+
+#ifndef TSLIB_NO_VT_WAITACTIVE
+		if (ioctl(con_fd, VT_WAITACTIVE, nr) < 0) {
+			perror("VT_WAITACTIVE");
+			close(con_fd);
+			return -1;
+		}
+#endif
+
+		if (ioctl(con_fd, KDSETMODE, KD_GRAPHICS) < 0) {
+			perror("KDSETMODE");
+			close(con_fd);
+			return -1;
+		}
+
+	}
+
+	fb_fd = open(fbdevice, O_RDWR);
+	if (fb_fd == -1) {
+		perror("open fbdevice");
+		__leave_vt();
+		return -1;
+	}
+
+	if (ioctl(fb_fd, FBIOGET_FSCREENINFO, fix) < 0) {
+		perror("ioctl FBIOGET_FSCREENINFO");
+		goto err;
+	}
+
+	if (ioctl(fb_fd, FBIOGET_VSCREENINFO, var) < 0) {
+		perror("ioctl FBIOGET_VSCREENINFO");
+		goto err;
+	}
+	orig_var = *var;
+	var_changed = 0;
+
+	*mem = mmap(NULL,
+		    fix->smem_len,
+		    PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED,
+		    fb_fd,
+		    0);
+
+	if (*mem == (unsigned char *)-1) {
+		perror("mmap framebuffer");
+		goto err;
+	}
+	smem_len = fix->smem_len;
+	cur_var = var;
+
+	have_saved_cmap = fix->visual == FB_VISUAL_PSEUDOCOLOR &&
+			  ioctl(fb_fd, FBIOGETCMAP, &saved_cmap) == 0;
+
+	return 0;
+
+err:
+	close(fb_fd);
+	fb_fd = -1;
+	__leave_vt();
+	return -1;
+}
+
+static void fbdev_close(unsigned char *mem)
+{
+	struct fb_fix_screeninfo fix;
+
+	/* set_pages() put it back unless the caller couldn't */
+	if (var_changed)
+		__restore_var(cur_var, &fix, &mem);
+
+	if (cur_var->yoffset != orig_var.yoffset) {
+		cur_var->yoffset = orig_var.yoffset;
+		if (ioctl(fb_fd, FBIOPAN_DISPLAY, cur_var) < 0)
+			perror("FBIOPAN_DISPLAY");
+	}
+
+	if (have_saved_cmap && ioctl(fb_fd, FBIOPUTCMAP, &saved_cmap) < 0)
+		perror("ioctl FBIOPUTCMAP");
+
+	if (mem)
+		munmap(mem, smem_len);
+	close(fb_fd);
+	fb_fd = -1;
+
+	__leave_vt();
+}
+
+static int fbdev_pan(struct fb_var_screeninfo *var)
+{
+	return ioctl(fb_fd, FBIOPAN_DISPLAY, var);
+}
+
+static int fbdev_wait_vsync(void)
+{
+	uint32_t zero = 0;
+
+	return ioctl(fb_fd, FBIO_WAITFORVSYNC, &zero);
+}
+
+static int fbdev_set_cmap(struct fb_cmap *cmap)
+{
+	if (ioctl(fb_fd, FBIOPUTCMAP, cmap) < 0) {
+		perror("ioctl FBIOPUTCMAP");
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct fb_backend fbdev_backend = {
+	.name = "fbdev",
+	.restore = 1,
+	.open = fbdev_open,
+	.close = fbdev_close,
+	.set_pages = fbdev_set_pages,
+	.pan = fbdev_pan,
+	.wait_vsync = fbdev_wait_vsync,
+	.set_cmap = fbdev_set_cmap,
+};
@@ -9,353 +9,1998 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
 #include <sys/time.h>
-#include <fcntl.h>
 
-#include <linux/vt.h>
-#include <linux/kd.h>
+#if !defined(LC_NO_SIMD) && defined(__SSE2__)
+# include <emmintrin.h>
+# define HAVE_SSE2_ROTATE
+# define HAVE_SSE2_BLEND
+#elif !defined(LC_NO_SIMD) && defined(__ARM_NEON)
+# include <arm_neon.h>
+# define HAVE_NEON_ROTATE
+# define HAVE_NEON_BLEND
+#endif
+
 #include <linux/fb.h>
 
 #include "font.h"
 #include "fbutils.h"
+#include "fbutils-backend.h"
 
 union multiptr {
 	uint8_t *p8;
 	uint16_t *p16;
 	uint32_t *p32;
+	uint64_t *p64;
 };
 
-static int32_t con_fd, last_vt = -1;
+static const struct fb_backend *backend;
 static struct fb_fix_screeninfo fix;
 static struct fb_var_screeninfo var;
 static unsigned char *fbuffer;
 static unsigned char **line_addr;
-static int32_t fb_fd;
 static int32_t bytes_per_pixel;
 static uint32_t transp_mask;
 static uint32_t colormap[256];
+/* What setpalette() was given, for dump_framebuffer() with a palette and
+ * to pack again for the next framebuffer opened. Entries from palette_len
+ * on were never set.
+ */
+static uint32_t palette[256];
+static uint32_t palette_len;
 uint32_t xres, yres;
 uint32_t xres_orig, yres_orig;
 int8_t rotation;
 int8_t alternative_cross;
+int8_t shadow_buffer;
+int8_t double_buffer;
+int32_t render_threads;
+uint32_t char_width = 8, char_height = 8;
+
+/* the font put_string() draws with, each font pixel as a scale x scale block */
+static const struct fbcon_font_desc *font = &font_vga_8x8;
+static int32_t font_scale = 1;
+
+/* With shadow_buffer set, everything is drawn into this copy in normal RAM
+ * and only the dirty rectangle is copied to fbuffer by flush_framebuffer().
+ * Reading back for XOR from uncached or write combined video memory is
+ * very slow on many SoCs.
+ */
+static unsigned char *shadow;
+static int32_t dirty_x1, dirty_y1, dirty_x2 = -1, dirty_y2 = -1;
+
+/* The buffer drawing goes to. Without shadow buffer it's the framebuffer
+ * and the writers rotate. The shadow buffer holds the logical, unrotated
+ * picture, and flush_framebuffer() rotates while copying, so that drawing
+ * in rotations 1 and 3 doesn't jump a framebuffer line per pixel. The
+ * dirty rectangle is in coordinates of this buffer.
+ */
+static int8_t draw_rotation;
+static int32_t draw_width, draw_height;
+static uint32_t draw_line_length;
+/* what the shadow buffer content was drawn for */
+static int8_t shadow_rotation;
+
+/* With double_buffer set and a driver that can pan, the shadow buffer is
+ * flushed into the hidden one of two pages, which is then panned to. The
+ * hidden page also misses what changed the frame before, hence prev_dirty.
+ */
+static int32_t nr_pages = 1, back_page;
+static int32_t prev_x1, prev_y1, prev_x2 = -1, prev_y2 = -1;
+static int8_t have_vsync;
+
+/* The page that was on screen when opening, and a copy of what it showed
+ * for close_framebuffer() to put back. Single buffered, that page is the
+ * one drawn on and other pages aren't touched.
+ */
+static uint32_t visible_offset, visible_len;
+static unsigned char *saved_screen;
+/* single buffered, where the page on screen is: the one from opening,
+ * after set_pages(), or the last one panned to before panning failed
+ */
+static uint32_t screen_offset;
+
+/* Strokes that fade, over the picture: per pixel of the shadow buffer a
+ * color index and a coverage, 0 for none. flush_framebuffer() blends them
+ * onto a copy of the damaged part of the shadow buffer, so that the
+ * picture below stays as it was drawn. The box holds every pixel with
+ * coverage.
+ */
+static uint8_t *overlay_alpha, *overlay_color;
+static unsigned char *composed;
+static int32_t overlay_x1, overlay_y1, overlay_x2 = -1, overlay_y2 = -1;
+
+enum {
+	BLEND_FIELDS,	/* any true color format, component by component */
+	BLEND_BYTES,	/* 32bpp with 8 bit components, all bytes alike */
+	BLEND_INDEX,	/* a palette, no mixing, the stroke wins above half */
+};
+static int8_t blend_kind;
+
+/* With render_threads above 1, fillrect() and flush_framebuffer() cut big
+ * jobs into bands of rows of the buffer written to, one per thread. A band
+ * is at least this big, or waking a thread costs more than it brings.
+ */
+#define BAND_MIN_BYTES	(128 * 1024)
+
+/* The cross of put_cross() as a sprite for show_cross(): rasterized once
+ * in the orientation and pixel format of the buffer drawn into, drawn
+ * pixel by pixel, row by row, after saving what was below.
+ */
+#define CROSS_RADIUS	10
+#define CROSS_SIZE	(2 * CROSS_RADIUS + 1)
+
+struct cross_pos {
+	uint8_t x, y;
+};
+
+static struct {
+	/* what the sprite was built for */
+	int8_t valid, style, rotation;
+	int32_t bpp;
+	uint32_t line_length, colidx, colors[2];
+
+	/* opaque pixels row by row, their colors in pixels[] */
+	struct cross_pos pos[CROSS_SIZE * CROSS_SIZE];
+	uint32_t offset[CROSS_SIZE * CROSS_SIZE];
+	int32_t nr_pixels;
+	uint32_t pixels[CROSS_SIZE * CROSS_SIZE];
+
+	/* where it is in the buffer drawn into: top left corner, clipped box */
+	int8_t shown;
+	int32_t x0, y0, x1, y1, x2, y2;
+	uint32_t save[CROSS_SIZE * CROSS_SIZE];
+} cross;
+
+struct fb_writer {
+	void (*pixel)(int32_t x, int32_t y, uint32_t color);
+	/* n pixels right of / below (x, y), already clipped */
+	void (*hspan)(int32_t x, int32_t y, int32_t n, uint32_t color);
+	void (*vspan)(int32_t x, int32_t y, int32_t n, uint32_t color);
+};
+
+/* bound to the pixel format and rotation, indexed by XOR mode */
+static const struct fb_writer *writers;
+
+/* Fill n pixels of one framebuffer row, a 64 bit word at a time once the
+ * address is aligned. Not for 24bpp.
+ */
+static inline void __fill_span(union multiptr loc, int32_t n, uint32_t color,
+			       int32_t bpp)
+{
+	uint64_t pattern;
+
+	switch (bpp) {
+	case 1:
+	default:
+		memset(loc.p8, color, n);
+		break;
+	case 2:
+		for (; n && ((uintptr_t)loc.p8 & 7); n--)
+			*loc.p16++ = color;
+		pattern = color & 0xffff;
+		pattern |= pattern << 16;
+		pattern |= pattern << 32;
+		for (; n >= 4; n -= 4)
+			*loc.p64++ = pattern;
+		while (n--)
+			*loc.p16++ = color;
+		break;
+	case 4:
+		for (; n && ((uintptr_t)loc.p8 & 7); n--)
+			*loc.p32++ = color;
+		pattern = color | ((uint64_t)color << 32);
+		for (; n >= 2; n -= 2)
+			*loc.p64++ = pattern;
+		if (n)
+			*loc.p32 = color;
+		break;
+	}
+}
+
+/* store one pixel: bytes per pixel, then XOR mode */
+static inline void __store_1_0(union multiptr loc, uint32_t color)
+{
+	*loc.p8 = color | transp_mask;
+}
+
+static inline void __store_1_1(union multiptr loc, uint32_t color)
+{
+	*loc.p8 = (*loc.p8 ^ color) | transp_mask;
+}
+
+static inline void __store_2_0(union multiptr loc, uint32_t color)
+{
+	*loc.p16 = color | transp_mask;
+}
+
+static inline void __store_2_1(union multiptr loc, uint32_t color)
+{
+	*loc.p16 = (*loc.p16 ^ color) | transp_mask;
+}
+
+static inline void __store_3_0(union multiptr loc, uint32_t color)
+{
+	loc.p8[0] = (color >> 16) & 0xff;
+	loc.p8[1] = (color >> 8) & 0xff;
+	loc.p8[2] = (color & 0xff) | transp_mask;
+}
+
+static inline void __store_3_1(union multiptr loc, uint32_t color)
+{
+	loc.p8[0] ^= (color >> 16) & 0xff;
+	loc.p8[1] ^= (color >> 8) & 0xff;
+	loc.p8[2] = (loc.p8[2] ^ (color & 0xff)) | transp_mask;
+}
+
+static inline void __store_4_0(union multiptr loc, uint32_t color)
+{
+	*loc.p32 = color | transp_mask;
+}
+
+static inline void __store_4_1(union multiptr loc, uint32_t color)
+{
+	*loc.p32 = (*loc.p32 ^ color) | transp_mask;
+}
+
+/* Address of logical pixel (x, y) for each rotation, and how many bytes
+ * one logical step in x and in y moves in the framebuffer.
+ */
+#define __LOC_0(x, y, b)	(line_addr[y] + (x) * (b))
+#define __LOC_1(x, y, b)	(line_addr[x] + (yres - (y) - 1) * (b))
+#define __LOC_2(x, y, b)	(line_addr[yres - (y) - 1] + (xres - (x) - 1) * (b))
+#define __LOC_3(x, y, b)	(line_addr[xres - (x) - 1] + (y) * (b))
+
+#define __XSTEP_0(b)		(b)
+#define __XSTEP_1(b)		((int32_t)draw_line_length)
+#define __XSTEP_2(b)		(-(b))
+#define __XSTEP_3(b)		(-(int32_t)draw_line_length)
+
+#define __YSTEP_0(b)		((int32_t)draw_line_length)
+#define __YSTEP_1(b)		(-(b))
+#define __YSTEP_2(b)		(-(int32_t)draw_line_length)
+#define __YSTEP_3(b)		(b)
+
+/* A run of n pixels with a constant step. Runs that are contiguous in
+ * memory get the word sized fill unless they need XOR or are 24bpp.
+ */
+#define __FB_RUN(b, xor, loc, step, n, color)				\
+	do {								\
+		if (!(xor) && (b) != 3 && (step) == (b)) {		\
+			__fill_span(loc, n, (color) | transp_mask, b);	\
+		} else if (!(xor) && (b) != 3 && (step) == -(b)) {	\
+			loc.p8 -= ((n) - 1) * (b);			\
+			__fill_span(loc, n, (color) | transp_mask, b);	\
+		} else {						\
+			for (; n > 0; n--, loc.p8 += (step))		\
+				__store_##b##_##xor(loc, color);	\
+		}							\
+	} while (0)
+
+#define FB_WRITER(b, r, xor)						\
+static void __pixel_##b##_##r##_##xor(int32_t x, int32_t y,		\
+				      uint32_t color)			\
+{									\
+	union multiptr loc;						\
+									\
+	loc.p8 = __LOC_##r(x, y, b);					\
+	__store_##b##_##xor(loc, color);				\
+}									\
+									\
+static void __hspan_##b##_##r##_##xor(int32_t x, int32_t y, int32_t n,	\
+				      uint32_t color)			\
+{									\
+	union multiptr loc;						\
+									\
+	loc.p8 = __LOC_##r(x, y, b);					\
+	__FB_RUN(b, xor, loc, __XSTEP_##r(b), n, color);		\
+}									\
+									\
+static void __vspan_##b##_##r##_##xor(int32_t x, int32_t y, int32_t n,	\
+				      uint32_t color)			\
+{									\
+	union multiptr loc;						\
+									\
+	loc.p8 = __LOC_##r(x, y, b);					\
+	__FB_RUN(b, xor, loc, __YSTEP_##r(b), n, color);		\
+}
+
+#define FB_WRITERS(b)							\
+	FB_WRITER(b, 0, 0) FB_WRITER(b, 0, 1)				\
+	FB_WRITER(b, 1, 0) FB_WRITER(b, 1, 1)				\
+	FB_WRITER(b, 2, 0) FB_WRITER(b, 2, 1)				\
+	FB_WRITER(b, 3, 0) FB_WRITER(b, 3, 1)
+
+FB_WRITERS(1)
+FB_WRITERS(2)
+FB_WRITERS(3)
+FB_WRITERS(4)
+
+#define FB_WRITER_ENTRY(b, r, xor)					\
+	{ __pixel_##b##_##r##_##xor, __hspan_##b##_##r##_##xor,		\
+	  __vspan_##b##_##r##_##xor }
+
+#define FB_WRITER_ROTATIONS(b)						\
+	{								\
+		{ FB_WRITER_ENTRY(b, 0, 0), FB_WRITER_ENTRY(b, 0, 1) },	\
+		{ FB_WRITER_ENTRY(b, 1, 0), FB_WRITER_ENTRY(b, 1, 1) },	\
+		{ FB_WRITER_ENTRY(b, 2, 0), FB_WRITER_ENTRY(b, 2, 1) },	\
+		{ FB_WRITER_ENTRY(b, 3, 0), FB_WRITER_ENTRY(b, 3, 1) },	\
+	}
+
+/* [bytes per pixel - 1][rotation][XOR] */
+static const struct fb_writer fb_writers[4][4][2] = {
+	FB_WRITER_ROTATIONS(1),
+	FB_WRITER_ROTATIONS(2),
+	FB_WRITER_ROTATIONS(3),
+	FB_WRITER_ROTATIONS(4),
+};
+
+static void __bind_writers(void)
+{
+	int32_t b = bytes_per_pixel;
+
+	if (b < 1 || b > 4)
+		b = 1;
+
+	writers = fb_writers[b - 1][draw_rotation & 3];
+}
+
+/* Copy the rectangle (x1, y1) - (x2, y2) of a w x h picture in src to dst
+ * turned by rotation r, the way __pixel_phys() maps logical positions to
+ * physical ones. Turning by (4 - r) & 3 goes the other way.
+ *
+ * Rotations 1 and 3 are a transpose. It goes in tiles small enough for the
+ * source rows of a tile to stay in cache, and writes each destination row
+ * of a tile in one sequential run, which write combining likes.
+ */
+#define ROTATE_TILE	16
+
+#if defined(HAVE_SSE2_ROTATE)
+/* 4 x 4 pixels at 32bpp, rows s0 to s3 become columns */
+static inline void __transpose_4x4(const uint8_t *s0, const uint8_t *s1,
+				   const uint8_t *s2, const uint8_t *s3,
+				   uint8_t *d0, uint8_t *d1, uint8_t *d2,
+				   uint8_t *d3)
+{
+	__m128i a = _mm_loadu_si128((const __m128i *)s0);
+	__m128i b = _mm_loadu_si128((const __m128i *)s1);
+	__m128i c = _mm_loadu_si128((const __m128i *)s2);
+	__m128i d = _mm_loadu_si128((const __m128i *)s3);
+	__m128i t0 = _mm_unpacklo_epi32(a, b);
+	__m128i t1 = _mm_unpacklo_epi32(c, d);
+	__m128i t2 = _mm_unpackhi_epi32(a, b);
+	__m128i t3 = _mm_unpackhi_epi32(c, d);
+
+	_mm_storeu_si128((__m128i *)d0, _mm_unpacklo_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)d1, _mm_unpackhi_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)d2, _mm_unpacklo_epi64(t2, t3));
+	_mm_storeu_si128((__m128i *)d3, _mm_unpackhi_epi64(t2, t3));
+}
+#elif defined(HAVE_NEON_ROTATE)
+static inline void __transpose_4x4(const uint8_t *s0, const uint8_t *s1,
+				   const uint8_t *s2, const uint8_t *s3,
+				   uint8_t *d0, uint8_t *d1, uint8_t *d2,
+				   uint8_t *d3)
+{
+	uint32x4x2_t ab = vtrnq_u32(vld1q_u32((const uint32_t *)s0),
+				    vld1q_u32((const uint32_t *)s1));
+	uint32x4x2_t cd = vtrnq_u32(vld1q_u32((const uint32_t *)s2),
+				    vld1q_u32((const uint32_t *)s3));
+
+	vst1q_u32((uint32_t *)d0, vcombine_u32(vget_low_u32(ab.val[0]),
+					       vget_low_u32(cd.val[0])));
+	vst1q_u32((uint32_t *)d1, vcombine_u32(vget_low_u32(ab.val[1]),
+					       vget_low_u32(cd.val[1])));
+	vst1q_u32((uint32_t *)d2, vcombine_u32(vget_high_u32(ab.val[0]),
+					       vget_high_u32(cd.val[0])));
+	vst1q_u32((uint32_t *)d3, vcombine_u32(vget_high_u32(ab.val[1]),
+					       vget_high_u32(cd.val[1])));
+}
+#endif
+
+/* One tile of a transpose. Destination row i holds source column x + i,
+ * read from source row ys on, sstep bytes at a time.
+ */
+#define __TRANSPOSE_TILE(type)						\
+	for (i = 0; i < tw; i++) {					\
+		const uint8_t *sp = src + ys * sstride + (x + i) * b;	\
+		type *dp = (type *)(drow + i * dstep);			\
+		for (j = 0; j < th; j++, sp += sstep)			\
+			*dp++ = *(const type *)sp;			\
+	}
+
+#define __REVERSE_ROW(type)						\
+	for (x = x2; x >= x1; x--, sp -= sizeof(type), dp += sizeof(type))	\
+		*(type *)dp = *(const type *)sp;
+
+static void __rotate_rect(const uint8_t *src, int32_t w, int32_t h,
+			  int32_t sstride, uint8_t *dst, int32_t dstride,
+			  int32_t r, int32_t x1, int32_t y1, int32_t x2,
+			  int32_t y2)
+{
+	const int32_t b = bytes_per_pixel;
+	int32_t x, y, ys, i, j, tw, th, sstep, dstep;
+	const uint8_t *sp;
+	uint8_t *dp, *drow;
+
+	switch (r & 3) {
+	case 0:
+	default:
+		if (x1 == 0 && x2 == w - 1 && sstride == dstride &&
+		    sstride == w * b) {
+			copy_bulk(dst + y1 * dstride, src + y1 * sstride,
+				  (y2 - y1 + 1) * sstride);
+			return;
+		}
+		for (y = y1; y <= y2; y++)
+			memcpy(dst + y * dstride + x1 * b,
+			       src + y * sstride + x1 * b, (x2 - x1 + 1) * b);
+		return;
+	case 2:
+		/* rows stay rows, backwards */
+		for (y = y1; y <= y2; y++) {
+			sp = src + y * sstride + x2 * b;
+			dp = dst + (h - 1 - y) * dstride + (w - 1 - x2) * b;
+			switch (b) {
+			case 1:
+				__REVERSE_ROW(uint8_t)
+				break;
+			case 2:
+				__REVERSE_ROW(uint16_t)
+				break;
+			case 4:
+				__REVERSE_ROW(uint32_t)
+				break;
+			default:
+				for (x = x2; x >= x1; x--, sp -= 3, dp += 3) {
+					dp[0] = sp[0];
+					dp[1] = sp[1];
+					dp[2] = sp[2];
+				}
+				break;
+			}
+		}
+		return;
+	case 1:
+	case 3:
+		break;
+	}
+
+	for (y = y1; y <= y2; y += ROTATE_TILE) {
+		th = y2 - y + 1 < ROTATE_TILE ? y2 - y + 1 : ROTATE_TILE;
+		for (x = x1; x <= x2; x += ROTATE_TILE) {
+			tw = x2 - x + 1 < ROTATE_TILE ? x2 - x + 1 : ROTATE_TILE;
+
+			/* first pixel of the destination row for source
+			 * column x, and how the source is walked to fill it
+			 */
+			if ((r & 3) == 1) {
+				drow = dst + x * dstride + (h - y - th) * b;
+				dstep = dstride;
+				ys = y + th - 1;
+				sstep = -sstride;
+			} else {
+				drow = dst + (w - 1 - x) * dstride + y * b;
+				dstep = -dstride;
+				ys = y;
+				sstep = sstride;
+			}
+
+#if defined(HAVE_SSE2_ROTATE) || defined(HAVE_NEON_ROTATE)
+			if (b == 4 && !(tw & 3) && !(th & 3)) {
+				for (i = 0; i < tw; i += 4) {
+					for (j = 0; j < th; j += 4) {
+						sp = src + ys * sstride + (x + i) * 4 +
+						     j * sstep;
+						dp = drow + i * dstep + j * 4;
+						__transpose_4x4(sp, sp + sstep,
+								sp + 2 * sstep,
+								sp + 3 * sstep,
+								dp, dp + dstep,
+								dp + 2 * dstep,
+								dp + 3 * dstep);
+					}
+				}
+			} else
+#endif
+			switch (b) {
+			case 1:
+				__TRANSPOSE_TILE(uint8_t)
+				break;
+			case 2:
+				__TRANSPOSE_TILE(uint16_t)
+				break;
+			case 4:
+				__TRANSPOSE_TILE(uint32_t)
+				break;
+			default:
+				for (i = 0; i < tw; i++) {
+					sp = src + ys * sstride + (x + i) * b;
+					dp = drow + i * dstep;
+					for (j = 0; j < th; j++, sp += sstep, dp += 3) {
+						dp[0] = sp[0];
+						dp[1] = sp[1];
+						dp[2] = sp[2];
+					}
+				}
+				break;
+			}
+		}
+	}
+}
+
+/* Rows of at least row_bytes each, in multiples of align, that make a band */
+static int32_t __band_rows(uint32_t row_bytes, int32_t align)
+{
+	int32_t rows = (BAND_MIN_BYTES + row_bytes - 1) / row_bytes;
+
+	return (rows + align - 1) / align * align;
+}
+
+struct rotate_job {
+	const uint8_t *src;
+	int32_t w, h, sstride;
+	uint8_t *dst;
+	int32_t dstride, r, x1, y1, x2, y2;
+};
+
+/* source rows become destination rows in rotations 0 and 2, source
+ * columns in 1 and 3, so that bands never share a destination row
+ */
+static void __rotate_band(void *arg, int32_t first, int32_t last)
+{
+	const struct rotate_job *j = arg;
+
+	if (j->r & 1)
+		__rotate_rect(j->src, j->w, j->h, j->sstride, j->dst,
+			      j->dstride, j->r, first, j->y1, last, j->y2);
+	else
+		__rotate_rect(j->src, j->w, j->h, j->sstride, j->dst,
+			      j->dstride, j->r, j->x1, first, j->x2, last);
+}
+
+/* __rotate_rect() on all render threads */
+static void __rotate_rect_pool(const uint8_t *src, int32_t w, int32_t h,
+			       int32_t sstride, uint8_t *dst, int32_t dstride,
+			       int32_t r, int32_t x1, int32_t y1, int32_t x2,
+			       int32_t y2)
+{
+	struct rotate_job j = {
+		src, w, h, sstride, dst, dstride, r & 3, x1, y1, x2, y2
+	};
+
+	/* whole tiles per band, the same as without threads */
+	if (j.r & 1)
+		pool_run(__rotate_band, &j, x1, x2,
+			 __band_rows((y2 - y1 + 1) * bytes_per_pixel,
+				     ROTATE_TILE));
+	else
+		pool_run(__rotate_band, &j, y1, y2,
+			 __band_rows((x2 - x1 + 1) * bytes_per_pixel, 1));
+}
+
+/* Bring the shadow buffer content from one rotation into another, through
+ * a physical copy of the picture.
+ */
+static void __rotate_shadow(int8_t from, int8_t to)
+{
+	int32_t w = (from & 1) ? var.yres : var.xres;
+	int32_t h = (from & 1) ? var.xres : var.yres;
+	uint8_t *tmp;
+
+	tmp = malloc(var.yres * fix.line_length);
+	if (!tmp) {
+		perror("malloc");
+		memset(shadow, 0, var.yres * fix.line_length);
+		return;
+	}
+
+	__rotate_rect_pool(shadow, w, h, w * bytes_per_pixel, tmp,
+			   fix.line_length, from, 0, 0, w - 1, h - 1);
+	w = (to & 1) ? var.yres : var.xres;
+	__rotate_rect_pool(tmp, var.xres, var.yres, fix.line_length, shadow,
+			   w * bytes_per_pixel, (4 - to) & 3, 0, 0,
+			   var.xres - 1, var.yres - 1);
+	free(tmp);
+}
+
+/* Text should be TEXT_MM tall, or a fortieth of the shorter side of the
+ * screen if that is more, and the longest line (40 characters) must fit.
+ * Small screens keep the 8x8 font, everything else gets 8x16 scaled 1x to
+ * 4x.
+ */
+#define TEXT_MM		3
+#define TEXT_COLUMNS	40
+
+static void __choose_font(void)
+{
+	uint32_t shorter = var.xres < var.yres ? var.xres : var.yres;
+	uint32_t target = shorter / TEXT_COLUMNS;
+
+	/* 0 or ~0 if the driver doesn't know */
+	if (var.height > 0 && var.height < 10000 &&
+	    var.yres * TEXT_MM / var.height > target)
+		target = var.yres * TEXT_MM / var.height;
+
+	if (target < 12) {
+		font = &font_vga_8x8;
+		font_scale = 1;
+	} else {
+		font = &font_vga_8x16;
+		font_scale = (target + 8) / 16;
+		if (font_scale > 4)
+			font_scale = 4;
+		while (font_scale > 1 &&
+		       (uint32_t)font_scale * font->width * TEXT_COLUMNS >
+		       shorter)
+			font_scale--;
+	}
+
+	char_width = font->width * font_scale;
+	char_height = font->height * font_scale;
+}
+
+/* 8 bits per pixel usually, but not always, index a palette */
+static int __has_cmap(void)
+{
+	return bytes_per_pixel == 1 && fix.visual != FB_VISUAL_TRUECOLOR;
+}
+
+/* What 0xRRGGBB value of palette entry colidx is in the buffer drawn into */
+static uint32_t __pack_color(uint32_t colidx, uint32_t value)
+{
+	uint32_t red = (value >> 16) & 0xff;
+	uint32_t green = (value >> 8) & 0xff;
+	uint32_t blue = value & 0xff;
+
+	if (__has_cmap())
+		return colidx;
+
+	return (red >> (8 - var.red.length)) << var.red.offset |
+	       (green >> (8 - var.green.length)) << var.green.offset |
+	       (blue >> (8 - var.blue.length)) << var.blue.offset;
+}
+
+/* Give the hardware palette entries first to first + nr - 1 of palette[],
+ * in one go.
+ */
+static void __upload_cmap(uint32_t first, uint32_t nr)
+{
+	uint16_t red[256], green[256], blue[256];
+	struct fb_cmap cmap;
+	uint32_t i;
+
+	/* closed: opening packs and uploads palette[] again */
+	if (!backend || !__has_cmap() || !backend->set_cmap || nr == 0)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		red[i] = (palette[first + i] >> 8) & 0xff00;
+		green[i] = palette[first + i] & 0xff00;
+		blue[i] = (palette[first + i] << 8) & 0xff00;
+	}
+	cmap.start = first;
+	cmap.len = nr;
+	cmap.red = red;
+	cmap.green = green;
+	cmap.blue = blue;
+	cmap.transp = NULL;
+
+	backend->set_cmap(&cmap);
+}
+
+/* Everything after the framebuffer memory is there, device or not */
+static int __setup_framebuffer(void)
+{
+	uint32_t y, addr;
+
+	xres_orig = var.xres;
+	yres_orig = var.yres;
+	__choose_font();
+
+	bytes_per_pixel = (var.bits_per_pixel + 7) / 8;
+	transp_mask = ((1U << var.transp.length) - 1) <<
+		var.transp.offset; /* transp.length unlikely > 32 */
+	/* with shadow buffer, rotated logical rows can outnumber these */
+	y = var.yres_virtual > var.xres ? var.yres_virtual : var.xres;
+	line_addr = malloc(sizeof(*line_addr) * y);
+	if (!line_addr) {
+		perror("malloc");
+		return -1;
+	}
+
+	if (shadow_buffer || double_buffer) {
+		shadow = calloc(var.yres, fix.line_length);
+		if (!shadow)
+			perror("shadow buffer, drawing directly");
+	}
+
+	/* shadow rows are set by set_rotation() */
+	addr = screen_offset;
+	for (y = 0; y < var.yres; y++, addr += fix.line_length)
+		line_addr[y] = fbuffer + addr;
+	shadow_rotation = rotation;
+	dirty_x2 = -1;
+	prev_x2 = -1;
+	cross.shown = 0;
+
+	nr_pages = 1;
+	back_page = 0;
+	if (double_buffer && shadow && backend->pan &&
+	    var.yres_virtual >= 2 * var.yres &&
+	    fix.smem_len >= 2 * var.yres * fix.line_length) {
+		var.yoffset = 0;
+		if (backend->pan(&var) == 0) {
+			nr_pages = 2;
+			back_page = 1;
+			have_vsync = backend->wait_vsync != NULL;
+		} else {
+			perror("pan, single buffering");
+		}
+	}
+
+	if (render_threads > 1)
+		pool_start(render_threads);
+
+	/* the colors set so far, in this format */
+	for (y = 0; y < palette_len; y++)
+		colormap[y] = __pack_color(y, palette[y]);
+	__upload_cmap(0, palette_len);
+
+	set_rotation(rotation);
+
+	/* the back page has whatever was there, the first two flushes
+	 * bring both pages up to date
+	 */
+	if (nr_pages == 2) {
+		dirty_x1 = 0;
+		dirty_y1 = 0;
+		dirty_x2 = draw_width - 1;
+		dirty_y2 = draw_height - 1;
+	}
+
+	return 0;
+}
+
+/* rotation, xres and yres always change together */
+void set_rotation(int8_t r)
+{
+	uint32_t y;
+
+	if (shadow && r != shadow_rotation) {
+		/* strokes don't turn with the picture */
+		overlay_clear();
+		/* pending changes go out in the old rotation */
+		flush_framebuffer();
+		__rotate_shadow(shadow_rotation, r);
+		shadow_rotation = r;
+		/* the back page misses the last frame, in unknown places */
+		if (prev_x2 >= 0) {
+			prev_x1 = 0;
+			prev_y1 = 0;
+			prev_x2 = ((r & 1) ? yres_orig : xres_orig) - 1;
+			prev_y2 = ((r & 1) ? xres_orig : yres_orig) - 1;
+		}
+	}
+
+	rotation = r;
+	if (rotation & 1) {
+		/* 1 or 3 */
+		xres = yres_orig;
+		yres = xres_orig;
+	} else {
+		/* 0 or 2 */
+		xres = xres_orig;
+		yres = yres_orig;
+	}
+
+	if (shadow) {
+		draw_rotation = 0;
+		draw_width = xres;
+		draw_height = yres;
+		draw_line_length = xres * bytes_per_pixel;
+		for (y = 0; y < yres; y++)
+			line_addr[y] = shadow + y * draw_line_length;
+	} else {
+		draw_rotation = rotation;
+		draw_width = var.xres;
+		draw_height = var.yres;
+		draw_line_length = fix.line_length;
+	}
+
+	__bind_writers();
+}
+
+/* Draw with a backend, on the page on screen, cleared */
+int open_framebuffer_backend(const struct fb_backend *b)
+{
+	if (b->open(&var, &fix, &fbuffer) < 0)
+		return -1;
+	backend = b;
+
+	visible_len = var.yres * fix.line_length;
+	visible_offset = var.yoffset * fix.line_length;
+	if (visible_offset + visible_len > fix.smem_len)
+		visible_offset = 0;
+
+	if (b->restore) {
+		saved_screen = malloc(visible_len);
+		if (saved_screen)
+			copy_bulk(saved_screen, fbuffer + visible_offset,
+				  visible_len);
+		else
+			perror("malloc, not restoring the screen");
+	}
+
+	/* only now, a mode change can wipe what was saved */
+	if (double_buffer && b->set_pages &&
+	    b->set_pages(&var, &fix, &fbuffer, 2) < 0 && !fbuffer) {
+		close_framebuffer();
+		return -1;
+	}
+
+	screen_offset = var.yoffset * fix.line_length;
+	if (screen_offset + var.yres * fix.line_length > fix.smem_len)
+		screen_offset = 0;
+	fill_bulk(fbuffer + screen_offset, 0, var.yres * fix.line_length);
+
+	if (__setup_framebuffer() < 0) {
+		close_framebuffer();
+		return -1;
+	}
+
+	return 0;
+}
+
+/* fbdev, or KMS if asked for with LC_DRMDEVICE or if there is no fbdev */
+int open_framebuffer(void)
+{
+	if (!getenv("LC_DRMDEVICE") &&
+	    open_framebuffer_backend(&fbdev_backend) == 0)
+		return 0;
+
+	return open_framebuffer_backend(&drm_backend);
+}
+
+void close_framebuffer(void)
+{
+	if (!backend)
+		return;
+
+	/* the mode from before first, changing it can wipe the screen */
+	if (backend->set_pages)
+		backend->set_pages(&var, &fix, &fbuffer, 1);
+
+	if (saved_screen && fbuffer)
+		copy_bulk(fbuffer + visible_offset, saved_screen, visible_len);
+	else if (backend->restore && fbuffer)
+		fill_bulk(fbuffer + visible_offset, 0, visible_len);
+	free(saved_screen);
+	saved_screen = NULL;
+	backend->close(fbuffer);
+	backend = NULL;
+	nr_pages = 1;
+
+	overlay_close();
+	pool_stop();
+	free(line_addr);
+	line_addr = NULL;
+	free(shadow);
+	shadow = NULL;
+	cross.shown = 0;
+
+	xres = 0;
+	yres = 0;
+	rotation = 0;
+}
+
+/* position in the buffer drawn into of a logical (rotated) one */
+static void __pixel_phys(int32_t x, int32_t y, int32_t *px, int32_t *py)
+{
+	switch (draw_rotation) {
+	case 0:
+	default:
+		*px = x;
+		*py = y;
+		break;
+	case 1:
+		*px = yres - y - 1;
+		*py = x;
+		break;
+	case 2:
+		*px = xres - x - 1;
+		*py = yres - y - 1;
+		break;
+	case 3:
+		*px = y;
+		*py = xres - x - 1;
+		break;
+	}
+}
+
+/* Add an already clipped rectangle of the buffer drawn into to what
+ * flush_framebuffer() has to copy.
+ */
+static void __damage_phys(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	if (!shadow)
+		return;
+
+	if (dirty_x2 < 0) {
+		dirty_x1 = x1;
+		dirty_y1 = y1;
+		dirty_x2 = x2;
+		dirty_y2 = y2;
+		return;
+	}
+
+	if (x1 < dirty_x1)
+		dirty_x1 = x1;
+	if (y1 < dirty_y1)
+		dirty_y1 = y1;
+	if (x2 > dirty_x2)
+		dirty_x2 = x2;
+	if (y2 > dirty_y2)
+		dirty_y2 = y2;
+}
+
+/* Same for a logical one */
+static void __damage(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	int32_t tmp;
+
+	if (!shadow)
+		return;
+
+	__pixel_phys(x1, y1, &x1, &y1);
+	__pixel_phys(x2, y2, &x2, &y2);
+	if (x1 > x2) { tmp = x1; x1 = x2; x2 = tmp; }
+	if (y1 > y2) { tmp = y1; y1 = y2; y2 = tmp; }
+
+	__damage_phys(x1, y1, x2, y2);
+}
+
+/* a pixel of the buffer drawn into, 24bpp the way __store_3_0() puts it */
+static inline uint32_t __load_pixel(const uint8_t *p, int32_t b)
+{
+	uint32_t v = 0;
+
+	if (b == 3)
+		return p[0] << 16 | p[1] << 8 | p[2];
+	memcpy(&v, p, b);
+
+	return v;
+}
+
+static inline void __put_pixel(uint8_t *p, int32_t b, uint32_t v)
+{
+	if (b == 3) {
+		p[0] = v >> 16;
+		p[1] = v >> 8;
+		p[2] = v;
+		return;
+	}
+	memcpy(p, &v, b);
+}
+
+/* How many of the n coverages at a are 0, 8 at a time. Strokes are thin,
+ * most of a row in the overlay box is just copied.
+ */
+static inline int32_t __zero_run(const uint8_t *a, int32_t n)
+{
+	int32_t i = 0;
+	uint64_t w;
+
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&w, a + i, 8);
+		if (w)
+			break;
+	}
+	while (i < n && !a[i])
+		i++;
+
+	return i;
+}
+
+/* one component of to over from, with coverage a of 255 */
+static inline uint32_t __blend_field(uint32_t from, uint32_t to, uint32_t a,
+				     const struct fb_bitfield *f)
+{
+	uint32_t max = (1U << f->length) - 1;
+	uint32_t s = (from >> f->offset) & max;
+	uint32_t d = (to >> f->offset) & max;
+
+	return ((d * a + s * (255 - a) + 127) / 255) << f->offset;
+}
+
+static void __blend_fields(const uint8_t *src, uint8_t *dst,
+			   const uint8_t *alpha, const uint8_t *color,
+			   int32_t n)
+{
+	int32_t b = bytes_per_pixel, x, run;
+	uint32_t s, c, a;
+
+	for (x = 0; x < n; x++) {
+		run = __zero_run(alpha + x, n - x);
+		if (run) {
+			memcpy(dst + x * b, src + x * b, run * b);
+			x += run - 1;
+			continue;
+		}
+		a = alpha[x];
+		c = colormap[color[x]] | transp_mask;
+		if (a < 255) {
+			s = __load_pixel(src + x * b, b);
+			c = __blend_field(s, c, a, &var.red) |
+			    __blend_field(s, c, a, &var.green) |
+			    __blend_field(s, c, a, &var.blue) | transp_mask;
+		}
+		__put_pixel(dst + x * b, b, c);
+	}
+}
+
+static void __blend_index(const uint8_t *src, uint8_t *dst,
+			  const uint8_t *alpha, const uint8_t *color,
+			  int32_t n)
+{
+	int32_t x, run;
+
+	for (x = 0; x < n; x++) {
+		run = __zero_run(alpha + x, n - x);
+		if (run) {
+			memcpy(dst + x, src + x, run);
+			x += run - 1;
+			continue;
+		}
+		dst[x] = alpha[x] >= 128 ? colormap[color[x]] | transp_mask :
+					   src[x];
+	}
+}
+
+#if defined(HAVE_SSE2_BLEND)
+/* half of 4 pixels, widened to 16 bits: (c * a + s * (255 - a)) / 255 */
+static inline __m128i __blend_half(__m128i s, __m128i c, __m128i a)
+{
+	__m128i t;
+
+	t = _mm_add_epi16(_mm_mullo_epi16(c, a),
+			  _mm_mullo_epi16(s, _mm_sub_epi16(_mm_set1_epi16(255),
+							   a)));
+	t = _mm_add_epi16(t, _mm_set1_epi16(128));
+
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+#elif defined(HAVE_NEON_BLEND)
+static inline uint8x8_t __blend_half(uint8x8_t s, uint8x8_t c, uint8x8_t a)
+{
+	uint16x8_t t;
+
+	t = vmull_u8(c, a);
+	t = vmlal_u8(t, s, vmvn_u8(a));
+	t = vaddq_u16(t, vdupq_n_u16(128));
+
+	return vaddhn_u16(t, vshrq_n_u16(t, 8));
+}
+#endif
+
+/* Every byte of a pixel is a component, or X or alpha that are the same
+ * in picture and stroke, so blending goes byte by byte without unpacking.
+ * Four pixels at a time where there are vector units.
+ */
+static void __blend_bytes(const uint8_t *src, uint8_t *dst,
+			  const uint8_t *alpha, const uint8_t *color,
+			  int32_t n)
+{
+	int32_t x = 0, i;
+	uint32_t c, a;
+	uint8_t cb[4];
+#if defined(HAVE_SSE2_BLEND) || defined(HAVE_NEON_BLEND)
+	uint32_t a4, c4[4];
+	int32_t run;
+
+	while (x + 4 <= n) {
+		run = __zero_run(alpha + x, n - x);
+		if (run) {
+			memcpy(dst + x * 4, src + x * 4, run * 4);
+			x += run;
+			continue;
+		}
+		memcpy(&a4, alpha + x, 4);
+		for (i = 0; i < 4; i++)
+			c4[i] = colormap[color[x + i]] | transp_mask;
+# if defined(HAVE_SSE2_BLEND)
+		{
+			const __m128i zero = _mm_setzero_si128();
+			__m128i vs, vc, va;
+
+			vs = _mm_loadu_si128((const __m128i *)(src + x * 4));
+			vc = _mm_loadu_si128((const __m128i *)c4);
+			/* each coverage in all 4 bytes of its pixel */
+			va = _mm_cvtsi32_si128(a4);
+			va = _mm_unpacklo_epi8(va, va);
+			va = _mm_unpacklo_epi16(va, va);
+			_mm_storeu_si128((__m128i *)(dst + x * 4),
+				_mm_packus_epi16(
+					__blend_half(_mm_unpacklo_epi8(vs, zero),
+						     _mm_unpacklo_epi8(vc, zero),
+						     _mm_unpacklo_epi8(va, zero)),
+					__blend_half(_mm_unpackhi_epi8(vs, zero),
+						     _mm_unpackhi_epi8(vc, zero),
+						     _mm_unpackhi_epi8(va, zero))));
+		}
+# else
+		{
+			uint8x16_t vs, vc, va;
+
+			vs = vld1q_u8(src + x * 4);
+			vc = vreinterpretq_u8_u32(vld1q_u32(c4));
+			/* each coverage in all 4 bytes of its pixel */
+			va = vreinterpretq_u8_u32(vmulq_n_u32(
+				vmovl_u16(vget_low_u16(vmovl_u8(vcreate_u8(a4)))),
+				0x01010101));
+			vst1q_u8(dst + x * 4,
+				 vcombine_u8(__blend_half(vget_low_u8(vs),
+							  vget_low_u8(vc),
+							  vget_low_u8(va)),
+					     __blend_half(vget_high_u8(vs),
+							  vget_high_u8(vc),
+							  vget_high_u8(va))));
+		}
+# endif
+		x += 4;
+	}
+#endif
+
+	for (; x < n; x++) {
+		a = alpha[x];
+		if (a == 0) {
+			memcpy(dst + x * 4, src + x * 4, 4);
+			continue;
+		}
+		c = colormap[color[x]] | transp_mask;
+		memcpy(cb, &c, 4);
+		for (i = 0; i < 4; i++)
+			dst[x * 4 + i] = (cb[i] * a + src[x * 4 + i] *
+					  (255 - a) + 127) / 255;
+	}
+}
+
+struct compose_job {
+	int32_t x1, x2;
+};
+
+/* rows of the shadow buffer with the overlay on top into composed */
+static void __compose_rows(void *arg, int32_t first, int32_t last)
+{
+	const struct compose_job *j = arg;
+	int32_t y, x1, x2, b = bytes_per_pixel;
+	uint32_t row;
+	size_t ov;
+
+	for (y = first; y <= last; y++) {
+		row = y * draw_line_length;
+		x1 = j->x1;
+		x2 = j->x2;
+		if (y >= overlay_y1 && y <= overlay_y2 &&
+		    x2 >= overlay_x1 && x1 <= overlay_x2) {
+			/* plain copies left and right of the box */
+			if (x1 < overlay_x1) {
+				memcpy(composed + row + x1 * b,
+				       shadow + row + x1 * b,
+				       (overlay_x1 - x1) * b);
+				x1 = overlay_x1;
+			}
+			if (x2 > overlay_x2) {
+				memcpy(composed + row + (overlay_x2 + 1) * b,
+				       shadow + row + (overlay_x2 + 1) * b,
+				       (x2 - overlay_x2) * b);
+				x2 = overlay_x2;
+			}
+			ov = (size_t)y * draw_width + x1;
+			switch (blend_kind) {
+			case BLEND_BYTES:
+				__blend_bytes(shadow + row + x1 * b,
+					      composed + row + x1 * b,
+					      overlay_alpha + ov,
+					      overlay_color + ov, x2 - x1 + 1);
+				break;
+			case BLEND_INDEX:
+				__blend_index(shadow + row + x1,
+					      composed + row + x1,
+					      overlay_alpha + ov,
+					      overlay_color + ov, x2 - x1 + 1);
+				break;
+			default:
+				__blend_fields(shadow + row + x1 * b,
+					       composed + row + x1 * b,
+					       overlay_alpha + ov,
+					       overlay_color + ov, x2 - x1 + 1);
+				break;
+			}
+		} else {
+			memcpy(composed + row + x1 * b, shadow + row + x1 * b,
+			       (x2 - x1 + 1) * b);
+		}
+	}
+}
+
+/* What flush_framebuffer() copies, the overlay blended in */
+static void __compose(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	struct compose_job j = { x1, x2 };
+
+	pool_run(__compose_rows, &j, y1, y2,
+		 __band_rows((x2 - x1 + 1) * bytes_per_pixel, 1));
+}
+
+/* Copy what changed in the shadow buffer to the framebuffer, one row at a
+ * time, with the overlay on top if there is one. Without shadow buffer
+ * everything is on screen already.
+ */
+void flush_framebuffer(void)
+{
+	int32_t x1 = dirty_x1, y1 = dirty_y1, x2 = dirty_x2, y2 = dirty_y2;
+	unsigned char *page = fbuffer, *src = shadow;
+
+	if (!shadow || dirty_x2 < 0)
+		return;
+
+	if (nr_pages == 2) {
+		page += back_page * var.yres * fix.line_length;
+		if (prev_x2 >= 0) {
+			if (prev_x1 < x1)
+				x1 = prev_x1;
+			if (prev_y1 < y1)
+				y1 = prev_y1;
+			if (prev_x2 > x2)
+				x2 = prev_x2;
+			if (prev_y2 > y2)
+				y2 = prev_y2;
+		}
+	} else {
+		page += screen_offset;
+	}
+
+	if (overlay_alpha) {
+		__compose(x1, y1, x2, y2);
+		src = composed;
+	}
+
+	__rotate_rect_pool(src, draw_width, draw_height, draw_line_length,
+			   page, fix.line_length, rotation, x1, y1, x2, y2);
+
+	if (nr_pages == 2) {
+		var.yoffset = back_page * var.yres;
+		if (backend->pan(&var) < 0) {
+			perror("pan, single buffering");
+			/* stay on the page on screen and bring it up to date */
+			nr_pages = 1;
+			back_page ^= 1;
+			screen_offset = back_page * var.yres * fix.line_length;
+			dirty_x1 = x1;
+			dirty_y1 = y1;
+			dirty_x2 = x2;
+			dirty_y2 = y2;
+			flush_framebuffer();
+			return;
+		}
+
+		/* don't draw into the old front page before it's gone */
+		if (have_vsync && backend->wait_vsync() < 0)
+			have_vsync = 0;
+
+		back_page ^= 1;
+		prev_x1 = dirty_x1;
+		prev_y1 = dirty_y1;
+		prev_x2 = dirty_x2;
+		prev_y2 = dirty_y2;
+	}
+
+	dirty_x2 = -1;
+}
+
+/* Nonzero if flush_framebuffer() waits for vertical blank, i.e. paces the
+ * caller to the display refresh by itself.
+ */
+int framebuffer_vsync(void)
+{
+	return shadow && nr_pages == 2 && have_vsync;
+}
+
+/* one color component of a pixel value, scaled to 8 bits */
+static uint8_t __component(uint32_t v, const struct fb_bitfield *f)
+{
+	uint32_t max = (1 << f->length) - 1;
+
+	if (f->length == 0)
+		return 0;
+
+	return ((v >> f->offset) & max) * 255 / max;
+}
+
+/* Write what is on screen, as the screen shows it, to path as binary PPM.
+ * What was drawn with shadow buffer is there after flush_framebuffer().
+ */
+int dump_framebuffer(const char *path)
+{
+	const unsigned char *row;
+	uint32_t x, y, v, b = bytes_per_pixel;
+	uint8_t *rgb;
+	FILE *f;
+	int ret = 0;
+
+	if (!backend)
+		return -1;
+
+	if (nr_pages == 2)
+		row = fbuffer + (back_page ^ 1) * var.yres * fix.line_length;
+	else
+		row = fbuffer + screen_offset;
+
+	rgb = malloc(var.xres * 3);
+	if (!rgb) {
+		perror("malloc");
+		return -1;
+	}
+
+	f = fopen(path, "wb");
+	if (!f) {
+		perror("fopen");
+		free(rgb);
+		return -1;
+	}
+
+	fprintf(f, "P6\n%u %u\n255\n", var.xres, var.yres);
+	for (y = 0; y < var.yres; y++, row += fix.line_length) {
+		for (x = 0; x < var.xres; x++) {
+			v = 0;
+			if (b == 3)
+				/* like __store_3_0() puts them */
+				v = row[x * 3] << 16 | row[x * 3 + 1] << 8 |
+				    row[x * 3 + 2];
+			else
+				memcpy(&v, row + x * b, b);
+			if (b == 1 && fix.visual != FB_VISUAL_TRUECOLOR)
+				v = palette[v];
+			else
+				v = __component(v, &var.red) << 16 |
+				    __component(v, &var.green) << 8 |
+				    __component(v, &var.blue);
+			rgb[x * 3] = v >> 16;
+			rgb[x * 3 + 1] = v >> 8;
+			rgb[x * 3 + 2] = v;
+		}
+		if (fwrite(rgb, 3, var.xres, f) != var.xres) {
+			perror("fwrite");
+			ret = -1;
+			break;
+		}
+	}
+
+	if (fclose(f) != 0 && ret == 0) {
+		perror("fclose");
+		ret = -1;
+	}
+	free(rgb);
+
+	return ret;
+}
+
+/* The cross as lines around its center: x1, y1, x2, y2, color index
+ * offset and the alternative_cross style it belongs to, -1 for all.
+ */
+static const int8_t cross_lines[][6] = {
+	{ -10,   0,  -2,   0, 0, -1 },
+	{   2,   0,  10,   0, 0, -1 },
+	{   0, -10,   0,  -2, 0, -1 },
+	{   0,   2,   0,  10, 0, -1 },
+
+	{  -6,  -9,  -9,  -9, 1,  0 },
+	{  -9,  -8,  -9,  -6, 1,  0 },
+	{  -9,   6,  -9,   9, 1,  0 },
+	{  -8,   9,  -6,   9, 1,  0 },
+	{   6,   9,   9,   9, 1,  0 },
+	{   9,   8,   9,   6, 1,  0 },
+	{   9,  -6,   9,  -9, 1,  0 },
+	{   8,  -9,   6,  -9, 1,  0 },
+
+	{  -7,  -7,  -4,  -4, 1,  1 },
+	{  -7,   7,  -4,   4, 1,  1 },
+	{   4,  -4,   7,  -7, 1,  1 },
+	{   4,   4,   7,   7, 1,  1 },
+};
+#define NR_CROSS_LINES (sizeof(cross_lines) / sizeof(cross_lines[0]))
+
+void put_cross(int32_t x, int32_t y, uint32_t colidx)
+{
+	uint32_t i;
+
+	for (i = 0; i < NR_CROSS_LINES; i++) {
+		if (cross_lines[i][5] >= 0 &&
+		    cross_lines[i][5] != alternative_cross)
+			continue;
+
+		line(x + cross_lines[i][0], y + cross_lines[i][1],
+		     x + cross_lines[i][2], y + cross_lines[i][3],
+		     colidx + cross_lines[i][4]);
+	}
+}
+
+static void __build_cross(uint32_t colidx)
+{
+	uint8_t mask[CROSS_SIZE][CROSS_SIZE];
+	int32_t b = bytes_per_pixel;
+	int32_t i, n, x, y, dx, dy, px, py;
+	const int8_t *l;
+	union multiptr loc;
+
+	memset(mask, 0, sizeof(mask));
+	for (i = 0; i < (int32_t)NR_CROSS_LINES; i++) {
+		l = cross_lines[i];
+		if (l[5] >= 0 && l[5] != alternative_cross)
+			continue;
+
+		/* only horizontal, vertical and 45 degree lines in there */
+		dx = (l[2] > l[0]) - (l[2] < l[0]);
+		dy = (l[3] > l[1]) - (l[3] < l[1]);
+		n = abs(l[2] - l[0]) > abs(l[3] - l[1]) ?
+		    abs(l[2] - l[0]) : abs(l[3] - l[1]);
+		for (x = l[0], y = l[1]; n >= 0; n--, x += dx, y += dy) {
+			/* logical offset from the center in the buffer drawn into */
+			switch (draw_rotation & 3) {
+			case 0: px = x; py = y; break;
+			case 1: px = -y; py = x; break;
+			case 2: px = -x; py = -y; break;
+			default: px = y; py = -x; break;
+			}
+			mask[py + CROSS_RADIUS][px + CROSS_RADIUS] = l[4] + 1;
+		}
+	}
+
+	cross.colors[0] = colormap[colidx & 0xff] | transp_mask;
+	cross.colors[1] = colormap[(colidx + 1) & 0xff] | transp_mask;
+	cross.nr_pixels = 0;
+	for (y = 0; y < CROSS_SIZE; y++) {
+		for (x = 0; x < CROSS_SIZE; x++) {
+			if (!mask[y][x])
+				continue;
+
+			loc.p8 = (uint8_t *)cross.pixels + cross.nr_pixels * b;
+			switch (b) {
+			case 1: __store_1_0(loc, cross.colors[mask[y][x] - 1]); break;
+			case 2: __store_2_0(loc, cross.colors[mask[y][x] - 1]); break;
+			case 3: __store_3_0(loc, cross.colors[mask[y][x] - 1]); break;
+			default: __store_4_0(loc, cross.colors[mask[y][x] - 1]); break;
+			}
+			cross.pos[cross.nr_pixels].x = x;
+			cross.pos[cross.nr_pixels].y = y;
+			cross.offset[cross.nr_pixels] = y * draw_line_length + x * b;
+			cross.nr_pixels++;
+		}
+	}
+
+	cross.valid = 1;
+	cross.style = alternative_cross;
+	cross.rotation = draw_rotation;
+	cross.bpp = b;
+	cross.line_length = draw_line_length;
+	cross.colidx = colidx;
+}
+
+static inline void __copy_pixel(uint8_t *dst, uint8_t *src, int32_t b)
+{
+	union multiptr d, s;
+
+	d.p8 = dst;
+	s.p8 = src;
+	switch (b) {
+	case 1:
+	default:
+		*d.p8 = *s.p8;
+		break;
+	case 2:
+		*d.p16 = *s.p16;
+		break;
+	case 3:
+		d.p8[0] = s.p8[0];
+		d.p8[1] = s.p8[1];
+		d.p8[2] = s.p8[2];
+		break;
+	case 4:
+		*d.p32 = *s.p32;
+		break;
+	}
+}
+
+enum { CROSS_SAVE, CROSS_BLIT, CROSS_RESTORE };
+
+/* Go over the opaque pixels of the cross at its current place, clipped,
+ * and save what is below them, draw them or put back what was saved.
+ * Nothing else in the box is touched.
+ */
+static void __cross_pixels(int32_t op)
+{
+	int32_t b = bytes_per_pixel;
+	int32_t x0 = cross.x0, y0 = cross.y0;
+	int32_t x1 = cross.x1, y1 = cross.y1, x2 = cross.x2, y2 = cross.y2;
+	int32_t i, x, y, n = cross.nr_pixels;
+	uint8_t *buf, *loc;
+
+	buf = (uint8_t *)(op == CROSS_BLIT ? cross.pixels : cross.save);
+
+	/* all on screen, rows are line_length apart */
+	if (x0 == x1 && y0 == y1 && x2 - x1 == CROSS_SIZE - 1 &&
+	    y2 - y1 == CROSS_SIZE - 1) {
+		loc = line_addr[y0] + x0 * b;
+		if (op == CROSS_SAVE) {
+			for (i = 0; i < n; i++, buf += b)
+				__copy_pixel(buf, loc + cross.offset[i], b);
+		} else {
+			for (i = 0; i < n; i++, buf += b)
+				__copy_pixel(loc + cross.offset[i], buf, b);
+		}
+		return;
+	}
 
-static char *defaultfbdevice = "/dev/fb0";
-static char *defaultconsoledevice = "/dev/tty";
-static char *fbdevice;
-static char *consoledevice;
+	for (i = 0; i < n; i++, buf += b) {
+		x = x0 + cross.pos[i].x;
+		y = y0 + cross.pos[i].y;
+		if (x < x1 || x > x2 || y < y1 || y > y2)
+			continue;
 
-#define VTNAME_LEN 128
+		loc = line_addr[y] + x * b;
+		if (op == CROSS_SAVE)
+			__copy_pixel(buf, loc, b);
+		else
+			__copy_pixel(loc, buf, b);
+	}
+}
 
-int open_framebuffer(void)
+/* Put back what was below the cross */
+void hide_cross(void)
 {
-	struct vt_stat vts;
-	char vtname[VTNAME_LEN];
-	int32_t fd, nr;
-	uint32_t y, addr;
-
-	if ((fbdevice = getenv("TSLIB_FBDEVICE")) == NULL)
-		fbdevice = defaultfbdevice;
+	if (!cross.shown)
+		return;
 
-	if ((consoledevice = getenv("TSLIB_CONSOLEDEVICE")) == NULL)
-		consoledevice = defaultconsoledevice;
+	__cross_pixels(CROSS_RESTORE);
+	__damage_phys(cross.x1, cross.y1, cross.x2, cross.y2);
+	cross.shown = 0;
+}
 
-	if (strcmp(consoledevice, "none") != 0) {
-		if (strlen(consoledevice) >= VTNAME_LEN)
-			return -1;
+/* Draw the cross with colors colidx and colidx + 1 at (x, y), moving it
+ * there if it is shown somewhere else already. Unlike put_cross() with
+ * XORMODE, nothing below it has to be read back pixel by pixel, and
+ * removing it is a copy of what was saved.
+ */
+void show_cross(int32_t x, int32_t y, uint32_t colidx)
+{
+	int32_t cx, cy;
 
-		sprintf(vtname, "%s%d", consoledevice, 1);
-		fd = open(vtname, O_WRONLY);
-		if (fd < 0) {
-			perror("open consoledevice");
-			return -1;
-		}
+	hide_cross();
 
-		if (ioctl(fd, VT_OPENQRY, &nr) < 0) {
-			close(fd);
-			perror("ioctl VT_OPENQRY");
-			return -1;
-		}
-		close(fd);
+	colidx &= ~XORMODE;
+	if (colidx > 254)
+		return;
 
-		sprintf(vtname, "%s%d", consoledevice, nr);
+	if (!cross.valid || cross.style != alternative_cross ||
+	    cross.rotation != draw_rotation || cross.bpp != bytes_per_pixel ||
+	    cross.line_length != draw_line_length ||
+	    cross.colidx != colidx ||
+	    cross.colors[0] != (colormap[colidx] | transp_mask) ||
+	    cross.colors[1] != (colormap[colidx + 1] | transp_mask))
+		__build_cross(colidx);
+
+	if (x < -CROSS_RADIUS || y < -CROSS_RADIUS ||
+	    x >= (int32_t)xres + CROSS_RADIUS ||
+	    y >= (int32_t)yres + CROSS_RADIUS)
+		return;
 
-		con_fd = open(vtname, O_RDWR | O_NDELAY);
-		if (con_fd < 0) {
-			perror("open tty");
-			return -1;
-		}
+	/* the center may be off screen by up to the radius, map it anyway */
+	__pixel_phys(x, y, &cx, &cy);
+	cross.x0 = cross.x1 = cx - CROSS_RADIUS;
+	cross.y0 = cross.y1 = cy - CROSS_RADIUS;
+	cross.x2 = cx + CROSS_RADIUS;
+	cross.y2 = cy + CROSS_RADIUS;
+	if (cross.x1 < 0)
+		cross.x1 = 0;
+	if (cross.y1 < 0)
+		cross.y1 = 0;
+	if (cross.x2 >= draw_width)
+		cross.x2 = draw_width - 1;
+	if (cross.y2 >= draw_height)
+		cross.y2 = draw_height - 1;
+	if (cross.x1 > cross.x2 || cross.y1 > cross.y2)
+		return;
 
-		if (ioctl(con_fd, VT_GETSTATE, &vts) == 0)
-			last_vt = vts.v_active;
+	__cross_pixels(CROSS_SAVE);
+	__cross_pixels(CROSS_BLIT);
+	__damage_phys(cross.x1, cross.y1, cross.x2, cross.y2);
+	cross.shown = 1;
+}
 
-		if (ioctl(con_fd, VT_ACTIVATE, nr) < 0) {
-			perror("VT_ACTIVATE");
-			close(con_fd);
-			return -1;
-		}
+/* Each bit of a glyph row expanded to a bytes_per_pixel wide byte mask,
+ * eight pixels at once.
+ */
+static uint64_t glyph_lut[256][4];
+static int32_t glyph_lut_bpp;
 
-#ifndef TSLIB_NO_VT_WAITACTIVE
-		if (ioctl(con_fd, VT_WAITACTIVE, nr) < 0) {
-			perror("VT_WAITACTIVE");
-			close(con_fd);
-			return -1;
-		}
-#endif
+static void __build_glyph_lut(void)
+{
+	int32_t b = bytes_per_pixel;
+	uint8_t *m;
+	int32_t v, k;
+
+	memset(glyph_lut, 0, sizeof(glyph_lut));
+	for (v = 0; v < 256; v++) {
+		m = (uint8_t *)glyph_lut[v];
+		for (k = 0; k < 8; k++)
+			if (v & (0x80 >> k))
+				memset(m + k * b, 0xff, b);
+	}
+	glyph_lut_bpp = b;
+}
 
-		if (ioctl(con_fd, KDSETMODE, KD_GRAPHICS) < 0) {
-			perror("KDSETMODE");
-			close(con_fd);
-			return -1;
-		}
+/* Strings as they are drawn: one bit per pixel, scaled and turned like
+ * the buffer drawn into. The same few texts are drawn over and over
+ * again, so they are kept, and a scaled font costs nothing extra per
+ * pixel.
+ */
+#define NR_TEXT_CACHE	16
+
+struct text_bitmap {
+	char *s;
+	const struct fbcon_font_desc *font;
+	int32_t scale;
+	int8_t rotation;
+	/* size in pixels as drawn, bytes per row */
+	int32_t w, h, stride;
+	uint8_t *bits;
+	uint32_t used;
+};
 
-	}
+static struct text_bitmap text_cache[NR_TEXT_CACHE];
+static uint32_t text_clock;
 
-	fb_fd = open(fbdevice, O_RDWR);
-	if (fb_fd == -1) {
-		perror("open fbdevice");
-		return -1;
+static struct text_bitmap *__text_bitmap(const char *s)
+{
+	struct text_bitmap *t = &text_cache[0];
+	int32_t len, w, h, n, j, lx, ly, c, r, bits;
+	const uint8_t *glyph;
+
+	for (n = 0; n < NR_TEXT_CACHE; n++) {
+		if (text_cache[n].s && text_cache[n].rotation == draw_rotation &&
+		    text_cache[n].font == font &&
+		    text_cache[n].scale == font_scale &&
+		    strcmp(text_cache[n].s, s) == 0) {
+			text_cache[n].used = ++text_clock;
+			return &text_cache[n];
+		}
+		if (text_cache[n].used < t->used)
+			t = &text_cache[n];
 	}
 
-	if (ioctl(fb_fd, FBIOGET_FSCREENINFO, &fix) < 0) {
-		perror("ioctl FBIOGET_FSCREENINFO");
-		close(fb_fd);
-		return -1;
+	free(t->s);
+	free(t->bits);
+	memset(t, 0, sizeof(*t));
+
+	len = strlen(s);
+	w = len * char_width;
+	h = char_height;
+	t->font = font;
+	t->scale = font_scale;
+	t->rotation = draw_rotation;
+	t->w = (draw_rotation & 1) ? h : w;
+	t->h = (draw_rotation & 1) ? w : h;
+	t->stride = (t->w + 7) / 8;
+	t->s = strdup(s);
+	t->bits = calloc(t->h, t->stride);
+	if (!t->s || !t->bits) {
+		perror("text cache");
+		free(t->s);
+		free(t->bits);
+		memset(t, 0, sizeof(*t));
+		return NULL;
 	}
 
-	if (ioctl(fb_fd, FBIOGET_VSCREENINFO, &var) < 0) {
-		perror("ioctl FBIOGET_VSCREENINFO");
-		close(fb_fd);
-		return -1;
+	for (n = 0; n < len; n++) {
+		glyph = font->data + font->height * (uint8_t)s[n];
+		for (ly = 0; ly < h; ly++) {
+			bits = glyph[ly / font_scale];
+			for (lx = n * char_width, j = 0; j < (int32_t)char_width;
+			     j++, lx++) {
+				if (!(bits & (0x80 >> (j / font_scale))))
+					continue;
+
+				/* logical (lx, ly) in the box drawn into */
+				switch (draw_rotation & 3) {
+				case 0:
+					c = lx;
+					r = ly;
+					break;
+				case 1:
+					c = h - 1 - ly;
+					r = lx;
+					break;
+				case 2:
+					c = w - 1 - lx;
+					r = h - 1 - ly;
+					break;
+				default:
+					c = ly;
+					r = w - 1 - lx;
+					break;
+				}
+				t->bits[r * t->stride + c / 8] |= 0x80 >> (c & 7);
+			}
+		}
 	}
 
-	xres_orig = var.xres;
-	yres_orig = var.yres;
+	t->used = ++text_clock;
+	return t;
+}
 
-	if (rotation & 1) {
-		/* 1 or 3 */
-		y = var.yres;
-		yres = var.xres;
-		xres = y;
-	} else {
-		/* 0 or 2 */
-		xres = var.xres;
-		yres = var.yres;
+/* Draw a text bitmap with its top left corner at (px, py) in the buffer
+ * drawn into. Rows are written eight pixels at a time, as a masked 64 bit
+ * read-modify-write per eight bytes, where they are completely on screen.
+ */
+static void __blit_text(const struct text_bitmap *t, int32_t px, int32_t py,
+			uint32_t color, uint32_t xormode)
+{
+	int32_t b = bytes_per_pixel;
+	uint64_t pattern[4], tpattern[4], mask, d;
+	int32_t r, k, n, x, y, w;
+	union multiptr loc;
+	const uint8_t *bits;
+	uint8_t *dst;
+
+	/* the color for eight pixels, and the transparency bits alone */
+	for (k = 0; k < 8; k++) {
+		loc.p8 = (uint8_t *)pattern + k * b;
+		switch (b) {
+		case 1: __store_1_0(loc, color); break;
+		case 2: __store_2_0(loc, color); break;
+		case 3: __store_3_0(loc, color); break;
+		default: __store_4_0(loc, color); break;
+		}
+		loc.p8 = (uint8_t *)tpattern + k * b;
+		switch (b) {
+		case 1: __store_1_0(loc, 0); break;
+		case 2: __store_2_0(loc, 0); break;
+		case 3: __store_3_0(loc, 0); break;
+		default: __store_4_0(loc, 0); break;
+		}
 	}
 
-	fbuffer = mmap(NULL,
-		       fix.smem_len,
-		       PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED,
-		       fb_fd,
-		       0);
-
-	if (fbuffer == (unsigned char *)-1) {
-		perror("mmap framebuffer");
-		close(fb_fd);
-		return -1;
+	for (r = 0; r < t->h; r++) {
+		y = py + r;
+		if (y < 0 || y >= draw_height)
+			continue;
+
+		bits = t->bits + r * t->stride;
+		for (x = px, n = 0; n < t->stride; n++, x += 8) {
+			if (!bits[n])
+				continue;
+
+			if (x >= 0 && x + 8 <= draw_width) {
+				dst = line_addr[y] + x * b;
+				for (k = 0; k < b; k++) {
+					mask = glyph_lut[bits[n]][k];
+					memcpy(&d, dst + k * 8, 8);
+					if (xormode)
+						d = (d ^ (pattern[k] & ~tpattern[k] & mask)) |
+						    (tpattern[k] & mask);
+					else
+						d = (d & ~mask) | (pattern[k] & mask);
+					memcpy(dst + k * 8, &d, 8);
+				}
+				continue;
+			}
+
+			/* at the left or right edge */
+			for (w = 0; w < 8; w++) {
+				if (!(bits[n] & (0x80 >> w)) ||
+				    x + w < 0 || x + w >= draw_width)
+					continue;
+
+				loc.p8 = line_addr[y] + (x + w) * b;
+				switch (b * 2 + !!xormode) {
+				case 2: __store_1_0(loc, color); break;
+				case 3: __store_1_1(loc, color); break;
+				case 4: __store_2_0(loc, color); break;
+				case 5: __store_2_1(loc, color); break;
+				case 6: __store_3_0(loc, color); break;
+				case 7: __store_3_1(loc, color); break;
+				case 8: __store_4_0(loc, color); break;
+				default: __store_4_1(loc, color); break;
+				}
+			}
+		}
 	}
-	memset(fbuffer, 0, fix.smem_len);
-
-	bytes_per_pixel = (var.bits_per_pixel + 7) / 8;
-	transp_mask = ((1 << var.transp.length) - 1) <<
-		var.transp.offset; /* transp.length unlikely > 32 */
-	line_addr = malloc(sizeof(*line_addr) * var.yres_virtual);
-	addr = 0;
-	for (y = 0; y < var.yres_virtual; y++, addr += fix.line_length)
-		line_addr[y] = fbuffer + addr;
-
-	return 0;
 }
 
-void close_framebuffer(void)
+void put_string(int32_t x, int32_t y, char *s, uint32_t colidx)
 {
-	memset(fbuffer, 0, fix.smem_len);
-	munmap(fbuffer, fix.smem_len);
-	close(fb_fd);
+	const struct text_bitmap *t;
+	int32_t px, py, x2, y2, tmp;
+	uint32_t xormode;
 
-	if (strcmp(consoledevice, "none") != 0) {
-		if (ioctl(con_fd, KDSETMODE, KD_TEXT) < 0)
-			perror("KDSETMODE");
+	if (!*s)
+		return;
 
-		if (last_vt >= 0)
-			if (ioctl(con_fd, VT_ACTIVATE, last_vt))
-				perror("VT_ACTIVATE");
+	xormode = colidx & XORMODE;
+	colidx &= ~XORMODE;
 
-		close(con_fd);
+	if (colidx > 255) {
+#ifdef DEBUG
+		fprintf(stderr, "WARNING: color value = %u, must be <256\n",
+			colidx);
+#endif
+		return;
 	}
 
-	free(line_addr);
+	if (glyph_lut_bpp != bytes_per_pixel)
+		__build_glyph_lut();
 
-	xres = 0;
-	yres = 0;
-	rotation = 0;
+	t = __text_bitmap(s);
+	if (!t)
+		return;
+
+	/* top left corner of the text in the buffer drawn into */
+	__pixel_phys(x, y, &px, &py);
+	if (draw_rotation & 1)
+		__pixel_phys(x + t->h - 1, y + t->w - 1, &x2, &y2);
+	else
+		__pixel_phys(x + t->w - 1, y + t->h - 1, &x2, &y2);
+	if (px > x2) { tmp = px; px = x2; x2 = tmp; }
+	if (py > y2) { tmp = py; py = y2; y2 = tmp; }
+
+	if (x2 < 0 || y2 < 0 || px >= draw_width || py >= draw_height)
+		return;
+
+	__blit_text(t, px, py, colormap[colidx], xormode);
+
+	__damage_phys(px < 0 ? 0 : px, py < 0 ? 0 : py,
+		      x2 >= draw_width ? draw_width - 1 : x2,
+		      y2 >= draw_height ? draw_height - 1 : y2);
 }
 
-void put_cross(int32_t x, int32_t y, uint32_t colidx)
+void put_string_center(int32_t x, int32_t y, char *s, uint32_t colidx)
 {
-	line(x - 10, y, x - 2, y, colidx);
-	line(x + 2, y, x + 10, y, colidx);
-	line(x, y - 10, x, y - 2, colidx);
-	line(x, y + 2, x, y + 10, colidx);
+	size_t sl = strlen(s);
 
-	if (!alternative_cross) {
-		line(x - 6, y - 9, x - 9, y - 9, colidx + 1);
-		line(x - 9, y - 8, x - 9, y - 6, colidx + 1);
-		line(x - 9, y + 6, x - 9, y + 9, colidx + 1);
-		line(x - 8, y + 9, x - 6, y + 9, colidx + 1);
-		line(x + 6, y + 9, x + 9, y + 9, colidx + 1);
-		line(x + 9, y + 8, x + 9, y + 6, colidx + 1);
-		line(x + 9, y - 6, x + 9, y - 9, colidx + 1);
-		line(x + 8, y - 9, x + 6, y - 9, colidx + 1);
-	} else if (alternative_cross == 1) {
-		line(x - 7, y - 7, x - 4, y - 4, colidx + 1);
-		line(x - 7, y + 7, x - 4, y + 4, colidx + 1);
-		line(x + 4, y - 4, x + 7, y - 7, colidx + 1);
-		line(x + 4, y + 4, x + 7, y + 7, colidx + 1);
-	}
+	put_string(x - (sl / 2) * char_width,
+		   y - char_height / 2, s, colidx);
 }
 
-static void put_char(int32_t x, int32_t y, int32_t c, int32_t colidx)
+/* Set nr palette entries from first on to the 0xRRGGBB values. Drawing
+ * with them afterwards only looks up colormap[], and formats with a
+ * hardware palette get all of them with a single ioctl.
+ */
+void setpalette(uint32_t first, uint32_t nr, const uint32_t *values)
 {
-	int32_t i, j, bits;
+	uint32_t i;
 
-	for (i = 0; i < font_vga_8x8.height; i++) {
-		bits = font_vga_8x8.data[font_vga_8x8.height * c + i];
-		for (j = 0; j < font_vga_8x8.width; j++, bits <<= 1)
-			if (bits & 0x80)
-				pixel(x + j, y + i, colidx);
+	if (first > 255 || nr > 256 - first) {
+#ifdef DEBUG
+		fprintf(stderr, "WARNING: color indices %u to %u, must be <256\n",
+			first, first + nr - 1);
+#endif
+		return;
 	}
-}
 
-void put_string(int32_t x, int32_t y, char *s, uint32_t colidx)
-{
-	int32_t i;
+	for (i = 0; i < nr; i++) {
+		palette[first + i] = values[i];
+		colormap[first + i] = __pack_color(first + i, values[i]);
+	}
+	if (first + nr > palette_len)
+		palette_len = first + nr;
 
-	for (i = 0; *s; i++, x += font_vga_8x8.width, s++)
-		put_char (x, y, *s, colidx);
+	__upload_cmap(first, nr);
 }
 
-void put_string_center(int32_t x, int32_t y, char *s, uint32_t colidx)
+void setcolor(uint32_t colidx, uint32_t value)
 {
-	size_t sl = strlen(s);
-
-	put_string(x - (sl / 2) * font_vga_8x8.width,
-		   y - font_vga_8x8.height / 2, s, colidx);
+	setpalette(colidx, 1, &value);
 }
 
-void setcolor(uint32_t colidx, uint32_t value)
+void pixel(int32_t x, int32_t y, uint32_t colidx)
 {
-	uint32_t res;
-	uint16_t red, green, blue;
-	struct fb_cmap cmap;
+	uint32_t xormode;
+
+	if ((x < 0) || ((uint32_t)x >= xres) ||
+	    (y < 0) || ((uint32_t)y >= yres))
+		return;
+
+	xormode = colidx & XORMODE;
+	colidx &= ~XORMODE;
 
 	if (colidx > 255) {
 #ifdef DEBUG
-		fprintf(stderr, "WARNING: color index = %u, must be <256\n",
+		fprintf(stderr, "WARNING: color value = %u, must be <256\n",
 			colidx);
 #endif
 		return;
 	}
 
-	switch (bytes_per_pixel) {
-	default:
-	case 1:
-		res = colidx;
-		red = (value >> 8) & 0xff00;
-		green = value & 0xff00;
-		blue = (value << 8) & 0xff00;
-		cmap.start = colidx;
-		cmap.len = 1;
-		cmap.red = &red;
-		cmap.green = &green;
-		cmap.blue = &blue;
-		cmap.transp = NULL;
-
-		if (ioctl(fb_fd, FBIOPUTCMAP, &cmap) < 0)
-			perror("ioctl FBIOPUTCMAP");
-		break;
-	case 2:
-	case 3:
-	case 4:
-		red = (value >> 16) & 0xff;
-		green = (value >> 8) & 0xff;
-		blue = value & 0xff;
-		res = ((red >> (8 - var.red.length)) << var.red.offset) |
-		      ((green >> (8 - var.green.length)) << var.green.offset) |
-		      ((blue >> (8 - var.blue.length)) << var.blue.offset);
-	}
-	colormap[colidx] = res;
+	writers[xormode ? 1 : 0].pixel(x, y, colormap[colidx]);
+	__damage(x, y, x, y);
 }
 
-static void __pixel_loc(int32_t x, int32_t y, union multiptr *loc)
+/* Cohen-Sutherland outcodes */
+#define CLIP_LEFT	0x1
+#define CLIP_RIGHT	0x2
+#define CLIP_TOP	0x4
+#define CLIP_BOTTOM	0x8
+
+static int32_t __outcode(int32_t x, int32_t y)
 {
-	switch (rotation) {
-	case 0:
-	default:
-		loc->p8 = line_addr[y] + x * bytes_per_pixel;
-		break;
-	case 1:
-		loc->p8 = line_addr[x] + (yres - y - 1) * bytes_per_pixel;
-		break;
-	case 2:
-		loc->p8 = line_addr[yres - y - 1] + (xres - x - 1) * bytes_per_pixel;
-		break;
-	case 3:
-		loc->p8 = line_addr[xres - x - 1] + y * bytes_per_pixel;
-		break;
-	}
+	int32_t code = 0;
+
+	if (x < 0)
+		code |= CLIP_LEFT;
+	else if (x >= (int32_t)xres)
+		code |= CLIP_RIGHT;
+
+	if (y < 0)
+		code |= CLIP_TOP;
+	else if (y >= (int32_t)yres)
+		code |= CLIP_BOTTOM;
+
+	return code;
 }
 
-static inline void __setpixel(union multiptr loc, uint32_t xormode, uint32_t color)
+/* Clip a line to the screen once, so that drawing it needs no per-pixel
+ * checks. Returns 0 if nothing of it is visible.
+ */
+static int32_t __clip_line(int32_t *x1, int32_t *y1, int32_t *x2, int32_t *y2)
 {
-	switch (bytes_per_pixel) {
-	case 1:
-	default:
-		if (xormode)
-			*loc.p8 ^= color;
-		else
-			*loc.p8 = color;
-		*loc.p8 |= transp_mask;
-		break;
-	case 2:
-		if (xormode)
-			*loc.p16 ^= color;
-		else
-			*loc.p16 = color;
-		*loc.p16 |= transp_mask;
-		break;
-	case 3:
-		if (xormode) {
-			*loc.p8++ ^= (color >> 16) & 0xff;
-			*loc.p8++ ^= (color >> 8) & 0xff;
-			*loc.p8 ^= color & 0xff;
+	const int64_t xmax = xres - 1;
+	const int64_t ymax = yres - 1;
+	int32_t c1 = __outcode(*x1, *y1);
+	int32_t c2 = __outcode(*x2, *y2);
+	int32_t c;
+	int64_t x, y;
+
+	while (1) {
+		if (!(c1 | c2))
+			return 1;
+		if (c1 & c2)
+			return 0;
+
+		/* an outside endpoint, moved onto the edge it is beyond */
+		c = c1 ? c1 : c2;
+		if (c & CLIP_TOP) {
+			x = *x1 + (int64_t)(*x2 - *x1) * (0 - *y1) / (*y2 - *y1);
+			y = 0;
+		} else if (c & CLIP_BOTTOM) {
+			x = *x1 + (int64_t)(*x2 - *x1) * (ymax - *y1) / (*y2 - *y1);
+			y = ymax;
+		} else if (c & CLIP_RIGHT) {
+			y = *y1 + (int64_t)(*y2 - *y1) * (xmax - *x1) / (*x2 - *x1);
+			x = xmax;
 		} else {
-			*loc.p8++ = (color >> 16) & 0xff;
-			*loc.p8++ = (color >> 8) & 0xff;
-			*loc.p8 = color & 0xff;
+			y = *y1 + (int64_t)(*y2 - *y1) * (0 - *x1) / (*x2 - *x1);
+			x = 0;
+		}
+
+		if (c == c1) {
+			*x1 = x;
+			*y1 = y;
+			c1 = __outcode(*x1, *y1);
+		} else {
+			*x2 = x;
+			*y2 = y;
+			c2 = __outcode(*x2, *y2);
 		}
-		*loc.p8 |= transp_mask;
-		break;
-	case 4:
-		if (xormode)
-			*loc.p32 ^= color;
-		else
-			*loc.p32 = color;
-		*loc.p32 |= transp_mask;
-		break;
 	}
 }
 
-void pixel(int32_t x, int32_t y, uint32_t colidx)
+void line(int32_t x1, int32_t y1, int32_t x2, int32_t y2, uint32_t colidx)
 {
-	uint32_t xormode;
-	union multiptr loc;
-
-	if ((x < 0) || ((uint32_t)x >= xres) ||
-	    (y < 0) || ((uint32_t)y >= yres))
-		return;
+	const struct fb_writer *w;
+	uint32_t xormode, color;
+	int32_t tmp, dx, dy, step, err;
 
 	xormode = colidx & XORMODE;
 	colidx &= ~XORMODE;
@@ -368,42 +2013,63 @@ void pixel(int32_t x, int32_t y, uint32_t colidx)
 		return;
 	}
 
-	__pixel_loc(x, y, &loc);
-	__setpixel(loc, xormode, colormap[colidx]);
-}
+	/* Put the endpoints in a fixed order before clipping, so that
+	 * drawing a line again in XOR mode, from either end, hits exactly
+	 * the same pixels.
+	 */
+	if (x1 > x2 || (x1 == x2 && y1 > y2)) {
+		tmp = x1; x1 = x2; x2 = tmp;
+		tmp = y1; y1 = y2; y2 = tmp;
+	}
 
-void line(int32_t x1, int32_t y1, int32_t x2, int32_t y2, uint32_t colidx)
-{
-	int32_t tmp;
-	int32_t dx = x2 - x1;
-	int32_t dy = y2 - y1;
+	if (!__clip_line(&x1, &y1, &x2, &y2))
+		return;
 
-	if (abs(dx) < abs(dy)) {
-		if (y1 > y2) {
-			tmp = x1; x1 = x2; x2 = tmp;
-			tmp = y1; y1 = y2; y2 = tmp;
-			dx = -dx; dy = -dy;
-		}
-		x1 <<= 16;
-		/* dy is apriori >0 */
-		dx = (dx << 16) / dy;
-		while (y1 <= y2) {
-			pixel(x1 >> 16, y1, colidx);
-			x1 += dx;
-			y1++;
+	w = &writers[xormode ? 1 : 0];
+	color = colormap[colidx];
+	__damage(x1, y1 < y2 ? y1 : y2, x2, y1 < y2 ? y2 : y1);
+
+	if (y1 == y2) {
+		w->hspan(x1, y1, x2 - x1 + 1, color);
+		return;
+	}
+
+	/* clipping can make a steep line vertical, going either way */
+	if (x1 == x2) {
+		w->vspan(x1, y1 < y2 ? y1 : y2, abs(y2 - y1) + 1, color);
+		return;
+	}
+
+	/* Bresenham */
+	if (x2 - x1 >= abs(y2 - y1)) {
+		dx = x2 - x1;
+		dy = abs(y2 - y1);
+		step = y2 > y1 ? 1 : -1;
+		err = dx / 2;
+		for (; x1 <= x2; x1++) {
+			w->pixel(x1, y1, color);
+			err -= dy;
+			if (err < 0) {
+				y1 += step;
+				err += dx;
+			}
 		}
 	} else {
-		if (x1 > x2) {
+		if (y1 > y2) {
 			tmp = x1; x1 = x2; x2 = tmp;
 			tmp = y1; y1 = y2; y2 = tmp;
-			dx = -dx; dy = -dy;
 		}
-		y1 <<= 16;
-		dy = dx ? (dy << 16) / dx : 0;
-		while (x1 <= x2) {
-			pixel(x1, y1 >> 16, colidx);
-			y1 += dy;
-			x1++;
+		dx = abs(x2 - x1);
+		dy = y2 - y1;
+		step = x2 > x1 ? 1 : -1;
+		err = dy / 2;
+		for (; y1 <= y2; y1++) {
+			w->pixel(x1, y1, color);
+			err -= dx;
+			if (err < 0) {
+				x1 += step;
+				err += dy;
+			}
 		}
 	}
 }
@@ -416,11 +2082,43 @@ void rect(int32_t x1, int32_t y1, int32_t x2, int32_t y2, uint32_t colidx)
 	line(x1, y2-1, x1, y1+1, colidx);
 }
 
+struct fill_job {
+	const struct fb_writer *w;
+	uint32_t color;
+	int32_t x1, y1, x2, y2;
+};
+
+/* whole rows of the buffer drawn into */
+static void __fill_rows(void *arg, int32_t first, int32_t last)
+{
+	const struct fill_job *j = arg;
+
+	fill_bulk(line_addr[first], j->color,
+		  (last - first + 1) * draw_line_length);
+}
+
+static void __fill_lines(void *arg, int32_t first, int32_t last)
+{
+	const struct fill_job *j = arg;
+
+	for (; first <= last; first++)
+		j->w->hspan(j->x1, first, j->x2 - j->x1 + 1, j->color);
+}
+
+static void __fill_columns(void *arg, int32_t first, int32_t last)
+{
+	const struct fill_job *j = arg;
+
+	for (; first <= last; first++)
+		j->w->vspan(first, j->y1, j->y2 - j->y1 + 1, j->color);
+}
+
 void fillrect(int32_t x1, int32_t y1, int32_t x2, int32_t y2, uint32_t colidx)
 {
-	int32_t tmp;
+	const struct fb_writer *w;
+	struct fill_job j;
+	int32_t tmp, bx1, by1, bx2, by2;
 	uint32_t xormode;
-	union multiptr loc;
 
 	/* Clipping and sanity checking */
 	if (x1 > x2) { tmp = x1; x1 = x2; x2 = tmp; }
@@ -461,12 +2159,300 @@ void fillrect(int32_t x1, int32_t y1, int32_t x2, int32_t y2, uint32_t colidx)
 	}
 
 	colidx = colormap[colidx];
+	w = &writers[xormode ? 1 : 0];
+	__damage(x1, y1, x2, y2);
+
+	/* whole rows of the buffer drawn into, like clearing the screen, are
+	 * one block of memory
+	 */
+	__pixel_phys(x1, y1, &bx1, &by1);
+	__pixel_phys(x2, y2, &bx2, &by2);
+	if (!xormode && bytes_per_pixel != 3 &&
+	    draw_line_length == (uint32_t)(draw_width * bytes_per_pixel) &&
+	    abs(bx2 - bx1) == draw_width - 1) {
+		colidx |= transp_mask;
+		if (bytes_per_pixel == 1)
+			colidx = (colidx & 0xff) * 0x01010101;
+		else if (bytes_per_pixel == 2)
+			colidx = (colidx & 0xffff) * 0x00010001;
+		j.color = colidx;
+		pool_run(__fill_rows, &j, by1 < by2 ? by1 : by2,
+			 by1 < by2 ? by2 : by1, __band_rows(draw_line_length, 1));
+		return;
+	}
+
+	/* go along whatever is contiguous in memory, a band of rows of the
+	 * buffer per thread
+	 */
+	j.w = w;
+	j.color = colidx;
+	j.x1 = x1;
+	j.y1 = y1;
+	j.x2 = x2;
+	j.y2 = y2;
+	if (draw_rotation & 1)
+		pool_run(__fill_columns, &j, x1, x2,
+			 __band_rows((y2 - y1 + 1) * bytes_per_pixel, 1));
+	else
+		pool_run(__fill_lines, &j, y1, y2,
+			 __band_rows((x2 - x1 + 1) * bytes_per_pixel, 1));
+}
+
+/* Strokes over the picture that fade away, see overlay_alpha. Needs the
+ * shadow buffer.
+ */
+int overlay_open(void)
+{
+	size_t n = (size_t)var.xres * var.yres;
+
+	if (!shadow)
+		return -1;
+	if (overlay_alpha)
+		return 0;
+
+	overlay_alpha = calloc(n, 1);
+	overlay_color = calloc(n, 1);
+	composed = malloc(var.yres * fix.line_length);
+	if (!overlay_alpha || !overlay_color || !composed) {
+		perror("overlay");
+		overlay_close();
+		return -1;
+	}
+	overlay_x2 = -1;
+
+	if (bytes_per_pixel == 1 && fix.visual != FB_VISUAL_TRUECOLOR)
+		blend_kind = BLEND_INDEX;
+	else if (bytes_per_pixel == 4 &&
+		 var.red.length == 8 && var.red.offset % 8 == 0 &&
+		 var.green.length == 8 && var.green.offset % 8 == 0 &&
+		 var.blue.length == 8 && var.blue.offset % 8 == 0 &&
+		 var.transp.offset % 8 == 0 &&
+		 (var.transp.length == 0 || var.transp.length == 8))
+		blend_kind = BLEND_BYTES;
+	else
+		blend_kind = BLEND_FIELDS;
+
+	return 0;
+}
+
+/* the picture below shows again after the next flush */
+void overlay_close(void)
+{
+	if (overlay_x2 >= 0)
+		__damage_phys(overlay_x1, overlay_y1, overlay_x2, overlay_y2);
+	overlay_x2 = -1;
+
+	free(overlay_alpha);
+	overlay_alpha = NULL;
+	free(overlay_color);
+	overlay_color = NULL;
+	free(composed);
+	composed = NULL;
+}
+
+void overlay_clear(void)
+{
+	int32_t y;
+
+	if (!overlay_alpha || overlay_x2 < 0)
+		return;
+
+	for (y = overlay_y1; y <= overlay_y2; y++)
+		memset(overlay_alpha + (size_t)y * draw_width + overlay_x1, 0,
+		       overlay_x2 - overlay_x1 + 1);
+	__damage_phys(overlay_x1, overlay_y1, overlay_x2, overlay_y2);
+	overlay_x2 = -1;
+}
+
+/* Subtract amount from the coverage of a row, the first and last pixel
+ * still covered in *first and *last. Returns 0 if none is.
+ */
+static int __fade_row(uint8_t *a, int32_t n, uint8_t amount,
+		      int32_t *first, int32_t *last)
+{
+	int32_t i = 0, f = -1, l = -1;
+#if defined(HAVE_SSE2_BLEND)
+	const __m128i sub = _mm_set1_epi8(amount);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+
+	for (; i + 16 <= n; i += 16) {
+		v = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+				  sub);
+		_mm_storeu_si128((__m128i *)(a + i), v);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) {
+			if (f < 0)
+				f = i;
+			l = i + 15;
+		}
+	}
+#elif defined(HAVE_NEON_BLEND)
+	const uint8x16_t sub = vdupq_n_u8(amount);
+	uint8x16_t v;
+	uint8x8_t any;
+
+	for (; i + 16 <= n; i += 16) {
+		v = vqsubq_u8(vld1q_u8(a + i), sub);
+		vst1q_u8(a + i, v);
+		any = vorr_u8(vget_low_u8(v), vget_high_u8(v));
+		if (vget_lane_u64(vreinterpret_u64_u8(any), 0)) {
+			if (f < 0)
+				f = i;
+			l = i + 15;
+		}
+	}
+#endif
+
+	for (; i < n; i++) {
+		a[i] = a[i] > amount ? a[i] - amount : 0;
+		if (a[i]) {
+			if (f < 0)
+				f = i;
+			l = i;
+		}
+	}
+
+	if (f < 0)
+		return 0;
+
+	/* down from blocks of 16 to pixels */
+	while (!a[f])
+		f++;
+	while (!a[l])
+		l--;
+	*first = f;
+	*last = l;
+
+	return 1;
+}
+
+/* Take amount of 255 off the coverage of every stroke, and shrink the box
+ * to what is left.
+ */
+void overlay_fade(uint32_t amount)
+{
+	int32_t y, f, l, x1 = -1, y1 = -1, x2 = -1, y2 = -1;
+
+	if (!overlay_alpha || overlay_x2 < 0 || amount == 0)
+		return;
+	if (amount > 255)
+		amount = 255;
+
+	__damage_phys(overlay_x1, overlay_y1, overlay_x2, overlay_y2);
+
+	for (y = overlay_y1; y <= overlay_y2; y++) {
+		if (!__fade_row(overlay_alpha + (size_t)y * draw_width +
+				overlay_x1, overlay_x2 - overlay_x1 + 1,
+				amount, &f, &l))
+			continue;
+		if (y1 < 0) {
+			y1 = y;
+			x1 = f;
+			x2 = l;
+		}
+		if (f < x1)
+			x1 = f;
+		if (l > x2)
+			x2 = l;
+		y2 = y;
+	}
+
+	if (y1 < 0) {
+		overlay_x2 = -1;
+		return;
+	}
+	overlay_x2 = overlay_x1 + x2;
+	overlay_x1 += x1;
+	overlay_y1 = y1;
+	overlay_y2 = y2;
+}
+
+/* a square of full coverage around (x, y), clipped */
+static void __overlay_dot(int32_t x, int32_t y, int32_t r, uint8_t colidx)
+{
+	int32_t x1 = x - r, x2 = x + r, y1 = y - r, y2 = y + r;
+	size_t ov;
+
+	if (x1 < 0)
+		x1 = 0;
+	if (y1 < 0)
+		y1 = 0;
+	if (x2 >= draw_width)
+		x2 = draw_width - 1;
+	if (y2 >= draw_height)
+		y2 = draw_height - 1;
 
 	for (; y1 <= y2; y1++) {
-		for (tmp = x1; tmp <= x2; tmp++) {
-			__pixel_loc(tmp, y1, &loc);
-			__setpixel(loc, xormode, colidx);
-			loc.p8 += bytes_per_pixel;
+		ov = (size_t)y1 * draw_width + x1;
+		memset(overlay_alpha + ov, 255, x2 - x1 + 1);
+		memset(overlay_color + ov, colidx, x2 - x1 + 1);
+	}
+}
+
+/* A stroke from (x1, y1) to (x2, y2), as wide as a pixel of the font is
+ * tall, fully covering what is below until overlay_fade() takes it away.
+ * The shadow buffer isn't rotated, so these are screen coordinates.
+ */
+void overlay_line(int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+		  uint32_t colidx)
+{
+	int32_t r = font_scale, dx, dy, sx, sy, err, e2;
+	int32_t bx1, by1, bx2, by2;
+
+	if (!overlay_alpha || colidx > 255)
+		return;
+
+	if (!__clip_line(&x1, &y1, &x2, &y2))
+		return;
+
+	bx1 = (x1 < x2 ? x1 : x2) - r;
+	bx2 = (x1 < x2 ? x2 : x1) + r;
+	by1 = (y1 < y2 ? y1 : y2) - r;
+	by2 = (y1 < y2 ? y2 : y1) + r;
+	if (bx1 < 0)
+		bx1 = 0;
+	if (by1 < 0)
+		by1 = 0;
+	if (bx2 >= draw_width)
+		bx2 = draw_width - 1;
+	if (by2 >= draw_height)
+		by2 = draw_height - 1;
+
+	/* Bresenham, all octants */
+	dx = abs(x2 - x1);
+	dy = -abs(y2 - y1);
+	sx = x1 < x2 ? 1 : -1;
+	sy = y1 < y2 ? 1 : -1;
+	err = dx + dy;
+	while (1) {
+		__overlay_dot(x1, y1, r, colidx);
+		if (x1 == x2 && y1 == y2)
+			break;
+		e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			x1 += sx;
 		}
+		if (e2 <= dx) {
+			err += dx;
+			y1 += sy;
+		}
+	}
+
+	__damage_phys(bx1, by1, bx2, by2);
+	if (overlay_x2 < 0) {
+		overlay_x1 = bx1;
+		overlay_y1 = by1;
+		overlay_x2 = bx2;
+		overlay_y2 = by2;
+		return;
 	}
+	if (bx1 < overlay_x1)
+		overlay_x1 = bx1;
+	if (by1 < overlay_y1)
+		overlay_y1 = by1;
+	if (bx2 > overlay_x2)
+		overlay_x2 = bx2;
+	if (by2 > overlay_y2)
+		overlay_y2 = by2;
 }
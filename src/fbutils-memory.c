@@ -0,0 +1,145 @@
+/*
+ * Copyright 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * Drawing into plain memory, in any pixel format, without a display. For
+ * benchmarks and for comparing what was drawn with dump_framebuffer().
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fbutils.h"
+#include "fbutils-backend.h"
+
+/* fourcc names as DRM has them, the components from the most significant
+ * bit down, little endian in memory
+ */
+static const struct {
+	const char *name;
+	uint32_t bits_per_pixel;
+	/* offset and length of red, green, blue and alpha */
+	uint8_t bits[4][2];
+} formats[] = {
+	{ "C8",       8,  { {  0, 8 }, {  0, 8 }, {  0, 8 }, {  0, 0 } } },
+	{ "RGB332",   8,  { {  5, 3 }, {  2, 3 }, {  0, 2 }, {  0, 0 } } },
+	{ "XRGB1555", 16, { { 10, 5 }, {  5, 5 }, {  0, 5 }, {  0, 0 } } },
+	{ "ARGB1555", 16, { { 10, 5 }, {  5, 5 }, {  0, 5 }, { 15, 1 } } },
+	{ "RGB565",   16, { { 11, 5 }, {  5, 6 }, {  0, 5 }, {  0, 0 } } },
+	{ "BGR565",   16, { {  0, 5 }, {  5, 6 }, { 11, 5 }, {  0, 0 } } },
+	{ "RGB888",   24, { { 16, 8 }, {  8, 8 }, {  0, 8 }, {  0, 0 } } },
+	{ "BGR888",   24, { {  0, 8 }, {  8, 8 }, { 16, 8 }, {  0, 0 } } },
+	{ "XRGB8888", 32, { { 16, 8 }, {  8, 8 }, {  0, 8 }, {  0, 0 } } },
+	{ "ARGB8888", 32, { { 16, 8 }, {  8, 8 }, {  0, 8 }, { 24, 8 } } },
+	{ "XBGR8888", 32, { {  0, 8 }, {  8, 8 }, { 16, 8 }, {  0, 0 } } },
+	{ "ABGR8888", 32, { {  0, 8 }, {  8, 8 }, { 16, 8 }, { 24, 8 } } },
+	{ "RGBA8888", 32, { { 24, 8 }, { 16, 8 }, {  8, 8 }, {  0, 8 } } },
+	{ "BGRA8888", 32, { {  8, 8 }, { 16, 8 }, { 24, 8 }, {  0, 8 } } },
+};
+
+/* what open_framebuffer_memory_format() asked for */
+static uint32_t mem_width, mem_height;
+static int mem_format;
+
+static int memory_open(struct fb_var_screeninfo *var,
+		       struct fb_fix_screeninfo *fix, unsigned char **mem)
+{
+	uint32_t pages = double_buffer ? 2 : 1;
+
+	memset(fix, 0, sizeof(*fix));
+	memset(var, 0, sizeof(*var));
+
+	var->xres = var->xres_virtual = mem_width;
+	var->yres = mem_height;
+	var->yres_virtual = pages * mem_height;
+	var->bits_per_pixel = formats[mem_format].bits_per_pixel;
+	var->red.offset = formats[mem_format].bits[0][0];
+	var->red.length = formats[mem_format].bits[0][1];
+	var->green.offset = formats[mem_format].bits[1][0];
+	var->green.length = formats[mem_format].bits[1][1];
+	var->blue.offset = formats[mem_format].bits[2][0];
+	var->blue.length = formats[mem_format].bits[2][1];
+	var->transp.offset = formats[mem_format].bits[3][0];
+	var->transp.length = formats[mem_format].bits[3][1];
+
+	strcpy(fix->id, "memory");
+	fix->visual = var->bits_per_pixel == 8 && var->blue.length == 8 ?
+		      FB_VISUAL_PSEUDOCOLOR : FB_VISUAL_TRUECOLOR;
+	fix->line_length = mem_width * ((var->bits_per_pixel + 7) / 8);
+	fix->smem_len = fix->line_length * var->yres_virtual;
+
+	*mem = calloc(1, fix->smem_len);
+	if (!*mem) {
+		perror("calloc framebuffer");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void memory_close(unsigned char *mem)
+{
+	free(mem);
+}
+
+/* nothing to show, yoffset is all there is to it */
+static int memory_pan(struct fb_var_screeninfo *var)
+{
+	(void)var;
+	return 0;
+}
+
+const struct fb_backend memory_backend = {
+	.name = "memory",
+	.open = memory_open,
+	.close = memory_close,
+	.pan = memory_pan,
+};
+
+/* Draw into memory in one of the formats above, by name, like "RGB565" */
+int open_framebuffer_memory_format(uint32_t width, uint32_t height,
+				   const char *format)
+{
+	int i;
+
+	for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++)
+		if (strcmp(formats[i].name, format) == 0)
+			break;
+	if (i == (int)(sizeof(formats) / sizeof(formats[0])) ||
+	    width == 0 || height == 0) {
+		fprintf(stderr, "No %ux%u %s memory framebuffer\n",
+			width, height, format);
+		return -1;
+	}
+
+	mem_width = width;
+	mem_height = height;
+	mem_format = i;
+
+	return open_framebuffer_backend(&memory_backend);
+}
+
+/* The common format of a depth: 8bpp has a palette, 16bpp is RGB565, 24
+ * and 32bpp are RGB888.
+ */
+int open_framebuffer_memory(uint32_t width, uint32_t height,
+			    uint32_t bits_per_pixel)
+{
+	switch (bits_per_pixel) {
+	case 8:
+		return open_framebuffer_memory_format(width, height, "C8");
+	case 16:
+		return open_framebuffer_memory_format(width, height, "RGB565");
+	case 24:
+		return open_framebuffer_memory_format(width, height, "RGB888");
+	case 32:
+		return open_framebuffer_memory_format(width, height, "XRGB8888");
+	default:
+		fprintf(stderr, "No %ubpp memory framebuffer\n", bits_per_pixel);
+		return -1;
+	}
+}
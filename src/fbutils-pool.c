@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * Worker threads for filling and flushing big parts of the screen. A job
+ * is a range of rows, cut into one band per thread, and the caller works
+ * on the first band itself. On high resolution screens a single core
+ * doesn't get near what the memory can take.
+ */
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fbutils.h"
+
+static struct {
+	pthread_t *threads;
+	/* started workers, the caller not counted */
+	int32_t nr;
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	uint32_t generation;
+	int32_t pending;
+	int8_t stop;
+
+	/* the current job */
+	void (*fn)(void *arg, int32_t first, int32_t last);
+	void *arg;
+	int32_t first, last, grain, nr_bands;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Rows of band i, in whole grains, the last band takes what's left */
+static void __band(int32_t i, int32_t *first, int32_t *last)
+{
+	int32_t grains = (pool.last - pool.first + pool.grain) / pool.grain;
+
+	*first = pool.first + grains * i / pool.nr_bands * pool.grain;
+	*last = pool.first + grains * (i + 1) / pool.nr_bands * pool.grain - 1;
+	if (*last > pool.last)
+		*last = pool.last;
+}
+
+static void *pool_thread(void *arg)
+{
+	int32_t band = (int32_t)(intptr_t)arg;
+	uint32_t seen = 0;
+	int32_t first, last;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.generation == seen && !pool.stop)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.stop)
+			break;
+		seen = pool.generation;
+		if (band >= pool.nr_bands)
+			continue;
+
+		__band(band, &first, &last);
+		pthread_mutex_unlock(&pool.lock);
+		pool.fn(pool.arg, first, last);
+		pthread_mutex_lock(&pool.lock);
+
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+/* Start nr - 1 workers, so that nr threads draw. Returns how many do. */
+int pool_start(int nr)
+{
+	sigset_t all, old;
+	int i;
+
+	pool_stop();
+	if (nr < 2)
+		return 1;
+
+	pool.threads = calloc(nr - 1, sizeof(*pool.threads));
+	if (!pool.threads) {
+		perror("calloc");
+		return 1;
+	}
+
+	/* new workers haven't seen any job */
+	pool.generation = 0;
+	pool.stop = 0;
+	/* Signals go to the caller. A handler on a worker would wait for the
+	 * job that worker is in, or join the worker from itself.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < nr - 1; i++) {
+		errno = pthread_create(&pool.threads[i], NULL, pool_thread,
+				       (void *)(intptr_t)(i + 1));
+		if (errno) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pool.nr = i;
+
+	return pool.nr + 1;
+}
+
+void pool_stop(void)
+{
+	if (!pool.threads)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	while (pool.nr--)
+		pthread_join(pool.threads[pool.nr], NULL);
+	pool.nr = 0;
+	free(pool.threads);
+	pool.threads = NULL;
+}
+
+/* Call fn for bands of the rows first to last, all at the same time, and
+ * return when all are done. Bands are whole multiples of grain rows, so
+ * there are no more bands than grains, and a job of a single grain runs
+ * right here without waking anyone.
+ */
+void pool_run(void (*fn)(void *arg, int32_t first, int32_t last), void *arg,
+	      int32_t first, int32_t last, int32_t grain)
+{
+	int32_t grains, band_first, band_last;
+
+	if (grain < 1)
+		grain = 1;
+	grains = (last - first + grain) / grain;
+	if (pool.nr == 0 || grains < 2) {
+		fn(arg, first, last);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.first = first;
+	pool.last = last;
+	pool.grain = grain;
+	pool.nr_bands = grains < pool.nr + 1 ? grains : pool.nr + 1;
+	pool.pending = pool.nr_bands - 1;
+	pool.generation++;
+	__band(0, &band_first, &band_last);
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	fn(arg, band_first, band_last);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
@@ -7,6 +7,7 @@
 #ifndef _FBUTILS_H
 #define _FBUTILS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* This constant, being ORed with the color index tells the library
@@ -19,16 +20,50 @@ extern uint32_t xres, yres;
 extern uint32_t xres_orig, yres_orig;
 extern int8_t rotation;
 extern int8_t alternative_cross;
+extern int8_t shadow_buffer;
+extern int8_t double_buffer;
+/* threads fillrect() and flush_framebuffer() may use, 0 or 1 for none */
+extern int32_t render_threads;
+/* size of a character put_string() draws */
+extern uint32_t char_width, char_height;
 
 int open_framebuffer(void);
 void close_framebuffer(void);
+void set_rotation(int8_t r);
+void flush_framebuffer(void);
+int framebuffer_vsync(void);
+int dump_framebuffer(const char *path);
 void setcolor(unsigned colidx, unsigned value);
+void setpalette(unsigned first, unsigned nr, const unsigned *values);
 void put_cross(int x, int y, unsigned colidx);
+void show_cross(int x, int y, unsigned colidx);
+void hide_cross(void);
 void put_string(int x, int y, char *s, unsigned colidx);
 void put_string_center(int x, int y, char *s, unsigned colidx);
 void pixel(int x, int y, unsigned colidx);
 void line(int x1, int y1, int x2, int y2, unsigned colidx);
 void rect(int x1, int y1, int x2, int y2, unsigned colidx);
 void fillrect(int x1, int y1, int x2, int y2, unsigned colidx);
+int overlay_open(void);
+void overlay_close(void);
+void overlay_clear(void);
+void overlay_fade(unsigned amount);
+void overlay_line(int x1, int y1, int x2, int y2, unsigned colidx);
+
+/* fbutils-memory.c */
+int open_framebuffer_memory(uint32_t width, uint32_t height,
+			    uint32_t bits_per_pixel);
+int open_framebuffer_memory_format(uint32_t width, uint32_t height,
+				   const char *format);
+
+/* fbutils-bulk.c */
+void fill_bulk(void *dst, uint32_t pattern, size_t len);
+void copy_bulk(void *dst, const void *src, size_t len);
+
+/* fbutils-pool.c */
+int pool_start(int nr);
+void pool_stop(void);
+void pool_run(void (*fn)(void *arg, int32_t first, int32_t last), void *arg,
+	      int32_t first, int32_t last, int32_t grain);
 
 #endif /* _FBUTILS_H */
@@ -14,10 +14,15 @@
 #include <signal.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
 #include "config.h"
 
@@ -25,21 +30,36 @@
 #include "lc.h"
 
 #define CROSS_BOUND_DIST	50
-
-static int palette[] = {
+/* pixels a new point may be off the running estimate before we complain */
+#define RLS_MAX_ERROR		CROSS_BOUND_DIST
+/* the cross takes this long to move to the next target */
+#define GLIDE_MS		300
+/* frame period when the display doesn't pace us, 60 Hz */
+#define FRAME_NS		(1000000000 / 60)
+
+static const unsigned int palette[] = {
 	0x000000, 0xffe080, 0xffffff, 0xe0c0a0, 0xff0000, 0x00ff00
 };
 #define NR_COLORS (sizeof(palette) / sizeof(palette[0]))
 
-/* [inactive] border fill text [active] border fill text */
-static int button_palette[6] = {
+/* raw samples of every touch go here with --record, see evaluate_sessions() */
+static FILE *record_file;
+static long record_start;
+
+/* [inactive] border fill text [active] border fill text [hit] border fill
+ * text
+ */
+static int button_palette[9] = {
 	1, 4, 2,
-	1, 5, 0
+	1, 5, 0,
+	1, 3, 0
 };
 
-void button_draw(struct ts_button *button)
+/* without flushing, for many buttons changing at once */
+static void button_paint(struct ts_button *button)
 {
-	int s = (button->flags & BUTTON_ACTIVE) ? 3 : 0;
+	int s = (button->flags & BUTTON_ACTIVE) ? 3 :
+		(button->flags & BUTTON_HIT) ? 6 : 0;
 
 	rect(button->x, button->y, button->x + button->w,
 	     button->y + button->h, button_palette[s]);
@@ -51,6 +71,12 @@ void button_draw(struct ts_button *button)
 			  button->text, button_palette[s + 2]);
 }
 
+void button_draw(struct ts_button *button)
+{
+	button_paint(button);
+	flush_framebuffer();
+}
+
 int button_handle(struct ts_button *button, int x, int y, unsigned int p)
 {
 	int inside = (x >= button->x) && (y >= button->y) &&
@@ -76,16 +102,121 @@ int button_handle(struct ts_button *button, int x, int y, unsigned int p)
 	return 0;
 }
 
-static int sort_by_x(const void *a, const void *b)
+/* Buttons by where they are: the screen in cells of cell_w x cell_h, each
+ * with the buttons that reach into it, so that finding the one under a
+ * touch looks at one cell, however many buttons there are.
+ */
+struct button_grid {
+	int cell_w, cell_h, cols, rows;
+	/* where the buttons of a cell start in index[], one more at the end */
+	int *first;
+	int *index;
+};
+
+/* cells a button reaches into, clipped to the grid */
+static void button_cells(const struct button_grid *grid,
+			 const struct ts_button *button,
+			 int *c1, int *r1, int *c2, int *r2)
+{
+	*c1 = button->x / grid->cell_w;
+	*r1 = button->y / grid->cell_h;
+	*c2 = (button->x + button->w - 1) / grid->cell_w;
+	*r2 = (button->y + button->h - 1) / grid->cell_h;
+	if (*c1 < 0)
+		*c1 = 0;
+	if (*r1 < 0)
+		*r1 = 0;
+	if (*c2 >= grid->cols)
+		*c2 = grid->cols - 1;
+	if (*r2 >= grid->rows)
+		*r2 = grid->rows - 1;
+}
+
+static int button_grid_build(struct button_grid *grid,
+			     const struct ts_button *buttons, int nr,
+			     int width, int height, int cell_w, int cell_h)
+{
+	int i, c, r, c1, r1, c2, r2, n, *fill;
+
+	grid->cell_w = cell_w;
+	grid->cell_h = cell_h;
+	grid->cols = (width + cell_w - 1) / cell_w;
+	grid->rows = (height + cell_h - 1) / cell_h;
+	n = grid->cols * grid->rows;
+	grid->first = calloc(n + 1, sizeof(int));
+	fill = calloc(n, sizeof(int));
+	if (!grid->first || !fill)
+		goto err;
+
+	/* count per cell, then where each cell starts */
+	for (i = 0; i < nr; i++) {
+		button_cells(grid, &buttons[i], &c1, &r1, &c2, &r2);
+		for (r = r1; r <= r2; r++)
+			for (c = c1; c <= c2; c++)
+				grid->first[r * grid->cols + c + 1]++;
+	}
+	for (i = 0; i < n; i++)
+		grid->first[i + 1] += grid->first[i];
+
+	grid->index = malloc((grid->first[n] + 1) * sizeof(int));
+	if (!grid->index)
+		goto err;
+
+	for (i = 0; i < nr; i++) {
+		button_cells(grid, &buttons[i], &c1, &r1, &c2, &r2);
+		for (r = r1; r <= r2; r++) {
+			for (c = c1; c <= c2; c++) {
+				n = r * grid->cols + c;
+				grid->index[grid->first[n] + fill[n]++] = i;
+			}
+		}
+	}
+
+	free(fill);
+	return 0;
+
+err:
+	perror("button grid");
+	free(fill);
+	free(grid->first);
+	grid->first = NULL;
+	return -1;
+}
+
+static void button_grid_free(struct button_grid *grid)
 {
-	return (((struct ts_calib_sample *)a)->x - ((struct ts_calib_sample *)b)->x);
+	free(grid->first);
+	grid->first = NULL;
+	free(grid->index);
+	grid->index = NULL;
 }
 
-static int sort_by_y(const void *a, const void *b)
+/* the button at (x, y), -1 if there is none */
+static int button_grid_find(const struct button_grid *grid,
+			    const struct ts_button *buttons, int x, int y)
 {
-	return (((struct ts_calib_sample *)a)->y - ((struct ts_calib_sample *)b)->y);
+	const struct ts_button *b;
+	int cell, i;
+
+	if (x < 0 || y < 0)
+		return -1;
+	if (x / grid->cell_w >= grid->cols || y / grid->cell_h >= grid->rows)
+		return -1;
+
+	cell = (y / grid->cell_h) * grid->cols + x / grid->cell_w;
+	for (i = grid->first[cell]; i < grid->first[cell + 1]; i++) {
+		b = &buttons[grid->index[i]];
+		if (x >= b->x && y >= b->y &&
+		    x < b->x + b->w && y < b->y + b->h)
+			return grid->index[i];
+	}
+
+	return -1;
 }
 
+static void render_stop(void);
+static void render_kill(void);
+
 /* Waits for the screen to be touched, averages x and y sample
  * coordinates until the end of contact
  */
@@ -93,7 +224,7 @@ void getxy(struct tsdev *ts, int *x, int *y)
 {
 #define MAX_SAMPLES 128
 	struct ts_calib_sample samp[MAX_SAMPLES];
-	int index, middle;
+	int index, i;
 	int ret;
 
 	/* Now collect up to MAX_SAMPLES touches into the samp array. */
@@ -106,6 +237,7 @@ void getxy(struct tsdev *ts, int *x, int *y)
 		ret = ts_read_raw(ts, &samp[index], 1);
 		if (ret < 0) {
 			perror("ts_read_raw");
+			render_stop();
 			close_framebuffer();
 			exit(1);
 		}
@@ -119,42 +251,17 @@ void getxy(struct tsdev *ts, int *x, int *y)
 
 	printf("Took %d samples...\n", index);
 
-	/*
-	 * At this point, we have samples in indices zero to (index-1)
-	 * which means that we have (index) number of samples.  We want
-	 * to calculate the median of the samples so that wild outliers
-	 * don't skew the result.  First off, let's assume that arrays
-	 * are one-based instead of zero-based.  If this were the case
-	 * and index was odd, we would need sample number ((index+1)/2)
-	 * of a sorted array; if index was even, we would need the
-	 * average of sample number (index/2) and sample number
-	 * ((index/2)+1).  To turn this into something useful for the
-	 * real world, we just need to subtract one off of the sample
-	 * numbers.  So for when index is odd, we need sample number
-	 * (((index+1)/2)-1).  Due to integer division truncation, we
-	 * can simplify this to just (index/2).  When index is even, we
-	 * need the average of sample number ((index/2)-1) and sample
-	 * number (index/2).  Calculate (index/2) now and we'll handle
-	 * the even odd stuff after we sort.
-	 */
-	middle = index/2;
-	if (x) {
-		qsort(samp, index, sizeof(struct ts_calib_sample), sort_by_x);
-		if (index & 1)
-			*x = samp[middle].x;
-		else
-			*x = (samp[middle-1].x + samp[middle].x) / 2;
-	}
-	if (y) {
-		qsort(samp, index, sizeof(struct ts_calib_sample), sort_by_y);
-		if (index & 1)
-			*y = samp[middle].y;
-		else
-			*y = (samp[middle-1].y + samp[middle].y) / 2;
+	if (record_file) {
+		for (i = 0; i < index; i++)
+			fprintf(record_file, "%d %d\n", samp[i].x, samp[i].y);
 	}
+
+	estimate_xy(samp, index, ESTIMATOR_MEDIAN, x, y);
 }
 static void sig(int sig)
 {
+	/* the render thread may be drawing into what this unmaps */
+	render_kill();
 	close_framebuffer();
 	fflush(stderr);
 	printf("signal %d caught\n", sig);
@@ -164,51 +271,291 @@ static void sig(int sig)
 
 static unsigned int getticks()
 {
-	static struct timeval ticks = {0};
-	static unsigned int val = 0;
+	struct timespec ticks;
+	unsigned int val;
 
-	gettimeofday(&ticks, NULL);
+	/* monotonic, a clock step must not cut an interval short */
+	clock_gettime(CLOCK_MONOTONIC, &ticks);
 	val = ticks.tv_sec * 1000;
-	val += ticks.tv_usec / 1000;
+	val += ticks.tv_nsec / 1000000;
 
 	return val;
 }
 
+/* When the frame after next is due. If drawing fell behind, that is now,
+ * and 1 is returned; don't try to catch up.
+ */
+static int next_frame(struct timespec *next)
+{
+	struct timespec now;
+
+	next->tv_nsec += FRAME_NS;
+	if (next->tv_nsec >= 1000000000) {
+		next->tv_nsec -= 1000000000;
+		next->tv_sec++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > next->tv_sec ||
+	    (now.tv_sec == next->tv_sec && now.tv_nsec >= next->tv_nsec)) {
+		*next = now;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Sleep until the next frame is due. If drawing fell behind, the glide
+ * just shows fewer positions.
+ */
+static void wait_frame(struct timespec *next)
+{
+	if (next_frame(next))
+		return;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR)
+		;
+}
+
+/* Drawing during calibration has a thread of its own, so that reading the
+ * touchscreen never waits for an animation. Commands go through a ring
+ * with one writer, the main thread, and one reader, the render thread,
+ * which needs no lock. A semaphore wakes the render thread when it ran
+ * out of work. Without the thread, commands run right away.
+ */
+#define NR_RENDER_CMDS	16	/* a power of 2 */
+
+enum {
+	RENDER_CROSS,	/* glide the cross from (x1, y1) to (x2, y2), leave it */
+	RENDER_HIDE,	/* take the cross away */
+	RENDER_QUIT,
+};
+
+struct render_cmd {
+	int op;
+	int x1, y1, x2, y2;
+};
+
+static struct {
+	struct render_cmd cmd[NR_RENDER_CMDS];
+	/* commands pushed and taken so far, only ever counting up */
+	atomic_uint head, tail;
+	sem_t wake;
+	pthread_t thread;
+	volatile sig_atomic_t running;
+	/* set by a signal: stop drawing now, queued commands or not */
+	atomic_int quit;
+	/* someone joins the thread, it returned */
+	atomic_int joined, done;
+} render;
+
+/* a command is waiting, one the render thread should get to quickly */
+static int render_pending(void)
+{
+	return atomic_load(&render.quit) ||
+	       atomic_load_explicit(&render.tail, memory_order_relaxed) !=
+	       atomic_load_explicit(&render.head, memory_order_acquire);
+}
+
+static void glide_cross(int from_x, int from_y, int to_x, int to_y);
+
+static void render_run(const struct render_cmd *cmd)
+{
+	switch (cmd->op) {
+	case RENDER_CROSS:
+		if (cmd->x1 >= 0)
+			glide_cross(cmd->x1, cmd->y1, cmd->x2, cmd->y2);
+		show_cross(cmd->x2, cmd->y2, 2);
+		flush_framebuffer();
+		break;
+	case RENDER_HIDE:
+		hide_cross();
+		flush_framebuffer();
+		break;
+	}
+}
+
+static void *render_thread(void *arg)
+{
+	struct render_cmd cmd;
+	unsigned int tail;
+
+	(void)arg;
+	while (!atomic_load(&render.quit)) {
+		tail = atomic_load_explicit(&render.tail, memory_order_relaxed);
+		if (tail == atomic_load_explicit(&render.head,
+						 memory_order_acquire)) {
+			/* posted once per command, so no wakeup gets lost */
+			while (sem_wait(&render.wake) < 0 && errno == EINTR)
+				;
+			continue;
+		}
+
+		cmd = render.cmd[tail % NR_RENDER_CMDS];
+		atomic_store_explicit(&render.tail, tail + 1,
+				      memory_order_release);
+		if (cmd.op == RENDER_QUIT)
+			break;
+		render_run(&cmd);
+	}
+
+	atomic_store(&render.done, 1);
+	return NULL;
+}
+
+static void render_push(int op, int x1, int y1, int x2, int y2)
+{
+	struct render_cmd cmd = { op, x1, y1, x2, y2 };
+	unsigned int head;
+
+	if (!render.running) {
+		render_run(&cmd);
+		return;
+	}
+
+	head = atomic_load_explicit(&render.head, memory_order_relaxed);
+	/* full, a whole ring behind: the glides get cut short, soon free */
+	while (head - atomic_load_explicit(&render.tail,
+					   memory_order_acquire) ==
+	       NR_RENDER_CMDS)
+		sched_yield();
+
+	render.cmd[head % NR_RENDER_CMDS] = cmd;
+	atomic_store_explicit(&render.head, head + 1, memory_order_release);
+	sem_post(&render.wake);
+}
+
+static void render_start(void)
+{
+	sigset_t all, old;
+	int ret;
+
+	atomic_store(&render.head, 0);
+	atomic_store(&render.tail, 0);
+	atomic_store(&render.quit, 0);
+	atomic_store(&render.joined, 0);
+	atomic_store(&render.done, 0);
+	if (sem_init(&render.wake, 0, 0) < 0) {
+		perror("sem_init, drawing in between");
+		return;
+	}
+
+	/* signals go to the main thread, sig() then stops this one first */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&render.thread, NULL, render_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "No render thread, drawing in between\n");
+		sem_destroy(&render.wake);
+		return;
+	}
+	render.running = 1;
+}
+
+/* after everything queued is drawn */
+static void render_stop(void)
+{
+	if (!render.running)
+		return;
+
+	render_push(RENDER_QUIT, 0, 0, 0, 0);
+	if (!atomic_exchange(&render.joined, 1))
+		pthread_join(render.thread, NULL);
+	render.running = 0;
+	sem_destroy(&render.wake);
+}
+
+/* From sig(): the thread leaves whatever it draws and is gone on return.
+ * Not from the render thread itself, for a fault in there.
+ */
+static void render_kill(void)
+{
+	if (!render.running || pthread_equal(pthread_self(), render.thread))
+		return;
+
+	atomic_store(&render.quit, 1);
+	sem_post(&render.wake);
+	if (!atomic_exchange(&render.joined, 1))
+		pthread_join(render.thread, NULL);
+	else
+		/* render_stop() was joining it when the signal came */
+		while (!atomic_load(&render.done))
+			sched_yield();
+}
+
+/* Move the cross from one target to the next in GLIDE_MS, whatever the
+ * display or the drawing speed. Positions come from the elapsed time, so
+ * slow frames are skipped rather than stretching the animation. If the
+ * next command is already waiting, the cross jumps to its target.
+ */
+static void glide_cross(int from_x, int from_y, int to_x, int to_y)
+{
+	unsigned int start = getticks(), t;
+	struct timespec next;
+	int cx, cy;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while ((t = getticks() - start) < GLIDE_MS && !render_pending()) {
+		cx = from_x + (to_x - from_x) * (int)t / GLIDE_MS;
+		cy = from_y + (to_y - from_y) * (int)t / GLIDE_MS;
+
+		show_cross(cx, cy, 2);
+		flush_framebuffer();
+		if (!framebuffer_vsync())
+			wait_frame(&next);
+	}
+}
+
 static void get_sample(struct tsdev *ts, calibration *cal,
 		       int index, int x, int y, char *name, short redo)
 {
 	static int last_x = -1, last_y;
+#ifndef LC_FIXED_POINT
+	double error;
+	int a[7];
+
+	if (index == 0)
+		rls_init(&cal->rls);
+#endif
 
 	if (redo) {
 		last_x = -1;
 		last_y = 0;
 	}
 
-	if (last_x != -1) {
-#define NR_STEPS 100
-		int dx = ((x - last_x) << 16) / NR_STEPS;
-		int dy = ((y - last_y) << 16) / NR_STEPS;
-		int i;
-
-		last_x <<= 16;
-		last_y <<= 16;
-		for (i = 0; i < NR_STEPS; i++) {
-			put_cross(last_x >> 16, last_y >> 16, 2 | XORMODE);
-			usleep(1000);
-			put_cross(last_x >> 16, last_y >> 16, 2 | XORMODE);
-			last_x += dx;
-			last_y += dy;
+	if (record_file) {
+		/* start over, a redo must not leave the aborted run behind */
+		if (index == 0) {
+			fflush(record_file);
+			if (ftruncate(fileno(record_file), record_start) < 0)
+				perror("ftruncate");
+			fseek(record_file, record_start, SEEK_SET);
 		}
+		fprintf(record_file, "target %d %d\n", x, y);
 	}
 
-	put_cross(x, y, 2 | XORMODE);
+	/* touches count from here, while the cross is still on its way */
+	render_push(RENDER_CROSS, last_x, last_y, x, y);
 	getxy(ts, &cal->x[index], &cal->y[index]);
-	put_cross(x, y, 2 | XORMODE);
+	render_push(RENDER_HIDE, 0, 0, 0, 0);
 
 	last_x = cal->xfb[index] = x;
 	last_y = cal->yfb[index] = y;
 
 	printf("%s : X = %4d Y = %4d\n", name, cal->x[index], cal->y[index]);
+
+#ifndef LC_FIXED_POINT
+	error = rls_update(&cal->rls, cal->x[index], cal->y[index], x, y);
+	if (error > RLS_MAX_ERROR)
+		printf(RED "%s is %.0f pixels off the previous points\n" RESET,
+		       name, error);
+
+	if (rls_matrix(&cal->rls, a))
+		printf("Provisional constants: %d %d %d %d %d %d %d (residual %.1f pixels)\n",
+		       a[0], a[1], a[2], a[3], a[4], a[5], a[6],
+		       cal->rls.residual);
+#endif
 }
 
 static void clearbuf(struct tsdev *ts)
@@ -237,6 +584,254 @@ static void clearbuf(struct tsdev *ts)
 	}
 }
 
+/* Touch trails fade out in this long */
+#define TRAIL_MS		1000
+
+/* where a raw sample would be without calibration, the input range
+ * stretched over the screen
+ */
+static void raw_to_screen(struct tsdev *ts, int x, int y, int *sx, int *sy)
+{
+	*sx = ts->input_res_x > 0 ? x * (int)ts->res_x / ts->input_res_x : x;
+	*sy = ts->input_res_y > 0 ? y * (int)ts->res_y / ts->input_res_y : y;
+}
+
+/* Targets of the verification screen: this many along the longer side */
+#define TARGETS_ALONG		24
+
+/* how far from the targets touches ended, with and without calibration */
+struct target_stats {
+	int touches;
+	double cal_sum, cal_max;
+	double raw_sum, raw_max;
+};
+
+/* Small targets in a regular grid over the whole screen, except where
+ * they would cover keep_out. Returns how many, -1 on failure.
+ */
+static int setup_targets(struct tsdev *ts, const struct ts_button *keep_out,
+			 struct ts_button **targets, struct button_grid *grid)
+{
+	struct ts_button *t;
+	int pitch, size, cols, rows, x0, y0, x, y, c, r, nr = 0;
+
+	pitch = (ts->res_x > ts->res_y ? ts->res_x : ts->res_y) / TARGETS_ALONG;
+	if (pitch < (int)char_height * 2)
+		pitch = char_height * 2;
+	size = pitch / 2;
+	cols = ts->res_x / pitch;
+	rows = ts->res_y / pitch;
+	x0 = (ts->res_x - cols * pitch) / 2;
+	y0 = (ts->res_y - rows * pitch) / 2;
+
+	t = malloc(cols * rows * sizeof(*t));
+	if (!t) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (r = 0; r < rows; r++) {
+		for (c = 0; c < cols; c++) {
+			x = x0 + c * pitch;
+			y = y0 + r * pitch;
+			if (x < keep_out->x + keep_out->w &&
+			    x + pitch > keep_out->x &&
+			    y < keep_out->y + keep_out->h &&
+			    y + pitch > keep_out->y)
+				continue;
+
+			t[nr].x = x + (pitch - size) / 2;
+			t[nr].y = y + (pitch - size) / 2;
+			t[nr].w = size;
+			t[nr].h = size;
+			t[nr].text = "";
+			t[nr].flags = 0;
+			nr++;
+		}
+	}
+
+	if (button_grid_build(grid, t, nr, ts->res_x, ts->res_y,
+			      pitch, pitch) < 0) {
+		free(t);
+		return -1;
+	}
+	*targets = t;
+
+	return nr;
+}
+
+static void target_error(struct target_stats *stats,
+			 const struct ts_button *target,
+			 const int *pos, const int *raw)
+{
+	int cx = target->x + target->w / 2, cy = target->y + target->h / 2;
+	double e;
+
+	stats->touches++;
+	e = lc_sqrt((double)(pos[0] - cx) * (pos[0] - cx) +
+		    (double)(pos[1] - cy) * (pos[1] - cy));
+	stats->cal_sum += e;
+	if (e > stats->cal_max)
+		stats->cal_max = e;
+	e = lc_sqrt((double)(raw[0] - cx) * (raw[0] - cx) +
+		    (double)(raw[1] - cy) * (raw[1] - cy));
+	stats->raw_sum += e;
+	if (e > stats->raw_max)
+		stats->raw_max = e;
+}
+
+/* Touch targets all over the screen to check the calibration. Every
+ * sample leaves a fading trail, red where it is without calibration,
+ * green where the calibration puts it, and a touch ending on a target
+ * counts how far from its center it was. Samples are handled as they
+ * come in, however fast the touchscreen reports, and the screen is
+ * updated once per frame, redrawing only the targets that changed.
+ * Releasing the Done button ends it.
+ */
+static void verify_calibration(struct tsdev *ts, calibration *cal)
+{
+	struct ts_button done = {
+		.text = "Done",
+	};
+	struct ts_button panel, *targets = NULL;
+	struct button_grid grid = { 0 };
+	struct target_stats stats = { 0 };
+	struct ts_calib_sample samp;
+	struct timespec next, now;
+	struct timeval tv;
+	fd_set fdset;
+	void (*stroke)(int, int, int, int, unsigned) = overlay_line;
+	int raw[2], pos[2] = { -1, -1 }, last_raw[2], last_pos[2], down = 0;
+	int nr_targets, active = -1, hit, i;
+	int8_t rotation_temp = rotation;
+	unsigned int start, faded = 0, fade;
+	long wait_us;
+	char *title = "Touch the targets to check";
+
+	set_rotation(0);
+	if (overlay_open() < 0)
+		/* trails that stay */
+		stroke = line;
+
+	/* text and the Done button in a box in the middle */
+	done.w = char_width * 10;
+	done.h = char_height * 3;
+	panel.w = (strlen(title) + 2) * char_width;
+	panel.h = char_height * 8 + done.h;
+	panel.x = (ts->res_x - panel.w) / 2;
+	panel.y = (ts->res_y - panel.h) / 2;
+	done.x = (ts->res_x - done.w) / 2;
+	done.y = panel.y + char_height * 7;
+
+	fillrect(0, 0, ts->res_x - 1, ts->res_y - 1, 0);
+	put_string_center(ts->res_x / 2, panel.y + char_height, title, 1);
+	put_string_center(ts->res_x / 2, panel.y + char_height * 3,
+			  "uncalibrated", 4);
+	put_string_center(ts->res_x / 2, panel.y + char_height * 5,
+			  "calibrated", 5);
+
+	nr_targets = setup_targets(ts, &panel, &targets, &grid);
+	for (i = 0; i < nr_targets; i++)
+		button_paint(&targets[i]);
+	button_draw(&done);
+	clearbuf(ts);
+
+	start = getticks();
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (1) {
+		/* wait for samples until the frame is due */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait_us = (next.tv_sec - now.tv_sec) * 1000000L +
+			  (next.tv_nsec - now.tv_nsec) / 1000;
+		if (wait_us < 0)
+			wait_us = 0;
+		tv.tv_sec = wait_us / 1000000;
+		tv.tv_usec = wait_us % 1000000;
+		FD_ZERO(&fdset);
+		FD_SET(ts->fd, &fdset);
+
+		if (select(ts->fd + 1, &fdset, NULL, NULL, &tv) > 0) {
+			if (ts_read_raw(ts, &samp, 1) < 0) {
+				perror("ts_read_raw");
+				break;
+			}
+
+			if (samp.tracking_id == -1) {
+				down = 0;
+				if (active >= 0) {
+					targets[active].flags = BUTTON_HIT;
+					button_paint(&targets[active]);
+					target_error(&stats, &targets[active],
+						     last_pos, last_raw);
+					active = -1;
+				}
+				if (button_handle(&done, pos[0], pos[1], 0))
+					break;
+				continue;
+			}
+
+			raw[0] = samp.x;
+			raw[1] = samp.y;
+			transform_points_fixed(cal->a, raw, pos, 1);
+			raw_to_screen(ts, samp.x, samp.y, &raw[0], &raw[1]);
+			if (!down) {
+				memcpy(last_raw, raw, sizeof(raw));
+				memcpy(last_pos, pos, sizeof(pos));
+				down = 1;
+			}
+			stroke(last_raw[0], last_raw[1], raw[0], raw[1], 4);
+			stroke(last_pos[0], last_pos[1], pos[0], pos[1], 5);
+			memcpy(last_raw, raw, sizeof(raw));
+			memcpy(last_pos, pos, sizeof(pos));
+
+			i = targets ? button_grid_find(&grid, targets,
+						       pos[0], pos[1]) : -1;
+			if (i != active) {
+				if (active >= 0) {
+					targets[active].flags &= ~BUTTON_ACTIVE;
+					button_paint(&targets[active]);
+				}
+				if (i >= 0) {
+					targets[i].flags |= BUTTON_ACTIVE;
+					button_paint(&targets[i]);
+				}
+				active = i;
+			}
+			button_handle(&done, pos[0], pos[1], 1);
+			continue;
+		}
+
+		/* the fade goes by time, not by frames drawn */
+		fade = (getticks() - start) * 255 / TRAIL_MS;
+		overlay_fade(fade - faded);
+		faded = fade;
+
+		/* with vsync, flushing waits for the frame by itself */
+		flush_framebuffer();
+		if (framebuffer_vsync())
+			clock_gettime(CLOCK_MONOTONIC, &next);
+		else
+			next_frame(&next);
+	}
+
+	if (stats.touches) {
+		for (i = 0, hit = 0; i < nr_targets; i++)
+			if (targets[i].flags & BUTTON_HIT)
+				hit++;
+		printf("%d of %d targets touched, %d times\n", hit, nr_targets,
+		       stats.touches);
+		printf("Calibrated:   %.1f pixels off on average, %.1f at most\n",
+		       stats.cal_sum / stats.touches, stats.cal_max);
+		printf("Uncalibrated: %.1f pixels off on average, %.1f at most\n",
+		       stats.raw_sum / stats.touches, stats.raw_max);
+	}
+
+	button_grid_free(&grid);
+	free(targets);
+	overlay_close();
+	set_rotation(rotation_temp);
+}
+
 int main(int argc, char **argv)
 {
 	struct tsdev *ts;
@@ -250,6 +845,8 @@ int main(int argc, char **argv)
 	unsigned int tick = 0;
 	/* TODO find sane default: */
 	unsigned int min_interval = 0;
+	int evaluate = 0;
+	int verify = 0;
 
 	signal(SIGSEGV, sig);
 	signal(SIGINT, sig);
@@ -262,10 +859,17 @@ int main(int argc, char **argv)
 			{ "version",      no_argument,       NULL, 'v' },
 			{ "min_interval", required_argument, NULL, 't' },
 			{ "timeout",      required_argument, NULL, 's' },
+			{ "record",       required_argument, NULL, 'o' },
+			{ "evaluate",     no_argument,       NULL, 'e' },
+			{ "shadow",       no_argument,       NULL, 'b' },
+			{ "double-buffer", no_argument,      NULL, 'd' },
+			{ "threads",      required_argument, NULL, 'j' },
+			{ "verify",       no_argument,       NULL, 'V' },
+			{ NULL,           0,                 NULL, 0 },
 		};
 
 		int option_index = 0;
-		int c = getopt_long(argc, argv, "hvr:t:s:", long_options, &option_index);
+		int c = getopt_long(argc, argv, "hvr:t:s:o:ebdj:V", long_options, &option_index);
 
 		errno = 0;
 		if (c == -1)
@@ -301,6 +905,43 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'o':
+			record_file = fopen(optarg, "w");
+			if (!record_file) {
+				perror("fopen");
+				return 1;
+			}
+			break;
+
+		case 'e':
+			evaluate = 1;
+			break;
+
+		case 'b':
+			/* extern in fbutils.h */
+			shadow_buffer = 1;
+			break;
+
+		case 'd':
+			/* extern in fbutils.h, implies the shadow buffer */
+			double_buffer = 1;
+			break;
+
+		case 'j':
+			/* extern in fbutils.h */
+			render_threads = atoi(optarg);
+			if (render_threads < 0 || render_threads > 64) {
+				fprintf(stderr, "Invalid number of threads\n");
+				return 0;
+			}
+			break;
+
+		case 'V':
+			verify = 1;
+			/* the trails are an overlay on the shadow buffer */
+			shadow_buffer = 1;
+			break;
+
 		default:
 			return 0;
 		}
@@ -313,6 +954,10 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* offline, the remaining arguments are recorded sessions */
+	if (evaluate)
+		return evaluate_sessions(argc - optind, argv + optind) < 0;
+
 	ts = ts_setup(NULL, 0);
 	if (!ts) {
 		perror("ts_setup");
@@ -326,23 +971,20 @@ int main(int argc, char **argv)
 	}
 
 
-	for (i = 0; i < NR_COLORS; i++)
-		setcolor(i, palette[i]);
+	setpalette(0, NR_COLORS, palette);
 
 	put_string_center(xres / 2, yres / 4,
 			  "Touchscreen calibration utility", 1);
-	put_string_center(xres / 2, yres / 4 + 20,
+	put_string_center(xres / 2, yres / 4 + char_height * 5 / 2,
 			  "Touch crosshair to calibrate", 2);
+	flush_framebuffer();
 
 	/* Clear the buffer */
 	clearbuf(ts);
 
 	/* ignore rotation for calibration. only save it.*/
 	int rotation_temp = rotation;
-	rotation = 0;
-	/* orig is without rotation */
-	xres = xres_orig;
-	yres = yres_orig;
+	set_rotation(0);
 
 	/* TODO do away with the global vars */
 	ts->res_x = xres;
@@ -351,6 +993,11 @@ int main(int argc, char **argv)
 	printf("framebuffer: xres = %d, yres = %d\n", ts->res_x, ts->res_y);
 	printf("input:       xres = %d, yres = %d\n", ts->input_res_x, ts->input_res_y);
 
+	if (record_file) {
+		fprintf(record_file, "screen %d %d\n", ts->res_x, ts->res_y);
+		record_start = ftell(record_file);
+	}
+
 	if ((abs(ts->input_res_x - ts->res_x) <= 1) &&
 	    (abs(ts->input_res_y - ts->res_y) <= 1)) {
 		printf("Your touchscreen might not need any calibration!\n");
@@ -362,6 +1009,9 @@ int main(int argc, char **argv)
 	uint32_t delta_x = ts->res_x / num_blocks;
 	uint32_t delta_y = ts->res_y / num_blocks;
 
+	/* the crosses, from here until the last sample */
+	render_start();
+
 redocalibration:
 	tick = getticks();
 	get_sample(ts, &cal, 0, delta_x, delta_y, "Top left", redo);
@@ -428,7 +1078,8 @@ redocalibration:
 	}
 #endif
 
-	rotation = rotation_temp;
+	render_stop();
+	set_rotation(rotation_temp);
 
 	if (perform_calibration (&cal)) {
 		printf("Calibration constants: ");
@@ -436,11 +1087,16 @@ redocalibration:
 			printf("%d ", cal.a[i]);
 		printf("\n");
 		i = 0;
+		if (verify)
+			verify_calibration(ts, &cal);
 	} else {
 		printf("Calibration failed.\n");
 		i = -1;
 	}
 
+	if (record_file)
+		fclose(record_file);
+
 	fillrect(0, 0, ts->res_x - 1, ts->res_y - 1, 0);
 	close_framebuffer();
 	close(ts->fd);
@@ -6,6 +6,8 @@
  * SPDX-License-Identifier: GPL-3.0
  */
 
+#include <stddef.h>
+
 #ifdef __FreeBSD__
 # include <dev/evdev/input.h>
 #endif
@@ -25,6 +27,7 @@ struct ts_button {
 	char *text;
 	int flags;
 #define BUTTON_ACTIVE 0x00000001
+#define BUTTON_HIT    0x00000002
 };
 
 struct ts_calib_sample {
@@ -74,15 +77,52 @@ enum {
 	NUM_POINTS
 };
 
+/* how the samples of one touch are reduced to a position */
+enum {
+	ESTIMATOR_MEDIAN = 0,
+	ESTIMATOR_MEAN,
+	ESTIMATOR_TRIMMED_MEAN,
+	NR_ESTIMATORS
+};
+
+/* running least squares fit, updated with every touched point */
+struct lc_rls {
+#define RLS_DELTA	1e8
+	double p[3][3];
+	double tx[3];
+	double ty[3];
+	double sse;
+	double residual;
+	int n;
+};
+
 /* TODO 4x only */
 typedef struct {
 	int x[5], xfb[5];
 	int y[5], yfb[5];
 	int a[7];
+	struct lc_rls rls;
+	int orientation;
+#define ORIENT_SWAP_XY		0x00000001
+#define ORIENT_INVERT_X		0x00000002
+#define ORIENT_INVERT_Y		0x00000004
 } calibration;
 
 void getxy(struct tsdev *ts, int *x, int *y);
+void estimate_xy(struct ts_calib_sample *samp, int index, int estimator,
+		 int *x, int *y);
+int detect_orientation(const calibration *cal);
 int perform_calibration(calibration *cal);
+int calibrate_float(calibration *cal);
+int calibrate_fixed(calibration *cal);
+double lc_sqrt(double value);
+void rls_init(struct lc_rls *rls);
+double rls_update(struct lc_rls *rls, int x, int y, int xfb, int yfb);
+int rls_matrix(const struct lc_rls *rls, int *a);
+void calibration_to_matrix(const int *a, float *m);
+void transform_points(const float *m, const float *in, float *out, size_t n);
+void transform_points_fixed(const int *a, const int *in, int *out, size_t n);
+int evaluate_sessions(int nr, char **paths);
 struct tsdev *ts_setup(const char *dev_name, int nonblock);
 int ts_read_raw(struct tsdev *ts, struct ts_calib_sample *samp, int nr);
 
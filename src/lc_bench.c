@@ -0,0 +1,790 @@
+/*
+ * Copyright (C) 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * Microbenchmarks, run with "make bench". The output is CSV, a line per
+ * case: name, value, unit and the 50th, 90th and 99th percentile of the
+ * time in ns, empty where there is none. "render" times a call, "trail"
+ * a frame. "lc_bench <benchmark> <text>" runs only the cases of a
+ * benchmark whose names contain text.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "fbutils.h"
+#include "lc.h"
+#include "hypatia.h"
+
+/* case names to run, from the command line */
+static const char *filter;
+
+#define NR_POINTS	(1 << 22)
+#define NR_ROUNDS	8
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int wanted(const char *name)
+{
+	return !filter || strstr(name, filter);
+}
+
+static int sort_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank */
+static double percentile(const double *sorted, int n, int p)
+{
+	int i = (p * n + 99) / 100 - 1;
+
+	return sorted[i < 0 ? 0 : i];
+}
+
+/* a line of the CSV, with the percentiles of n sorted times in ns */
+static void result(const char *name, double value, const char *unit,
+		   const double *ns, int n)
+{
+	if (!wanted(name))
+		return;
+
+	printf("%s,%.4f,%s,", name, value, unit);
+	if (n)
+		printf("%.1f,%.1f,%.1f\n", percentile(ns, n, 50),
+		       percentile(ns, n, 90), percentile(ns, n, 99));
+	else
+		printf(",,\n");
+	fflush(stdout);
+}
+
+static void report(const char *name, double count, double seconds,
+		   const char *unit)
+{
+	result(name, count / seconds / 1e6, unit, NULL, 0);
+}
+
+#define MULTIPLY	"transform/matrix3_multiplyv2"
+#define TRANSFORM	"transform/transform_points"
+
+static void bench_transform(void)
+{
+	const int a[7] = { -1234567, 12345, 321, 7654321, -210, 23456, 65536 };
+	struct matrix3 hm;
+	struct vector2 v, r;
+	float m[6];
+	float *in, *out;
+	double t, sum = 0;
+	int i, round;
+
+	if (!wanted(MULTIPLY) && !wanted(TRANSFORM))
+		return;
+
+	in = malloc(NR_POINTS * 2 * sizeof(float));
+	out = malloc(NR_POINTS * 2 * sizeof(float));
+	if (!in || !out) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < NR_POINTS * 2; i++)
+		in[i] = rand() % 4096;
+
+	calibration_to_matrix(a, m);
+
+	/* hypatia keeps the translation in c20/c21 for matrix3_multiplyv2 */
+	matrix3_identity(&hm);
+	hm.c00 = m[0];	hm.c01 = m[1];	hm.c20 = m[2];
+	hm.c10 = m[3];	hm.c11 = m[4];	hm.c21 = m[5];
+
+	t = now();
+	for (round = 0; round < NR_ROUNDS && wanted(MULTIPLY); round++) {
+		for (i = 0; i < NR_POINTS; i++) {
+			v.x = in[2 * i];
+			v.y = in[2 * i + 1];
+			matrix3_multiplyv2(&hm, &v, &r);
+			out[2 * i] = r.x;
+			out[2 * i + 1] = r.y;
+		}
+		sum += out[round];
+	}
+	report(MULTIPLY, (double)NR_POINTS * NR_ROUNDS, now() - t, "Mpoints/s");
+
+	t = now();
+	for (round = 0; round < NR_ROUNDS && wanted(TRANSFORM); round++) {
+		transform_points(m, in, out, NR_POINTS);
+		sum += out[round];
+	}
+	report(TRANSFORM, (double)NR_POINTS * NR_ROUNDS, now() - t, "Mpoints/s");
+
+	/* keep the compiler from dropping the loops */
+	if (sum == 0.1234)
+		printf("\n");
+
+	free(in);
+	free(out);
+}
+
+#define NR_SESSIONS	4096
+
+/* a made up session: a panel with random gain, offset and orientation */
+static void fake_session(calibration *cal, int xres, int yres)
+{
+	const int fbx[NUM_POINTS] = { xres / 8, xres - xres / 8 - 1,
+				      xres - xres / 8 - 1, xres / 8 };
+	const int fby[NUM_POINTS] = { yres / 8, yres / 8,
+				      yres - yres / 8 - 1, yres - yres / 8 - 1 };
+	double gx = 2 + rand() % 3000 / 100.0;
+	double gy = 2 + rand() % 3000 / 100.0;
+	int ox = rand() % 500, oy = rand() % 500;
+	int orientation = rand() % 8;
+	int i, x, y, tmp;
+
+	memset(cal, 0, sizeof(*cal));
+	for (i = 0; i < NUM_POINTS; i++) {
+		x = ox + fbx[i] * gx + rand() % 5;
+		y = oy + fby[i] * gy + rand() % 5;
+		if (orientation & ORIENT_INVERT_X)
+			x = 32767 - x;
+		if (orientation & ORIENT_INVERT_Y)
+			y = 32767 - y;
+		if (orientation & ORIENT_SWAP_XY) {
+			tmp = x; x = y; y = tmp;
+		}
+		cal->x[i] = x;
+		cal->y[i] = y;
+		cal->xfb[i] = fbx[i];
+		cal->yfb[i] = fby[i];
+	}
+	cal->orientation = detect_orientation(cal);
+}
+
+/* Compares the Q16.16 solver and transform against the float reference
+ * over the whole panel and reports the largest difference in pixels.
+ */
+static const char *const fixed_cases[] = {
+	"fixed/calibrate_float", "fixed/calibrate_fixed",
+	"fixed/max_error", "fixed/mean_error", "fixed/failed",
+};
+#define NR_FIXED_CASES	(sizeof(fixed_cases) / sizeof(fixed_cases[0]))
+
+static void bench_fixed(void)
+{
+	static calibration cal[NR_SESSIONS];
+	int a[NR_SESSIONS][7];
+	int in[2], out[2];
+	float m[6], ref[2], pin[2];
+	double t, err, max_err = 0, sum_err = 0;
+	int i, x, y, n = 0, failed = 0;
+
+	/* the errors need both solves, so any case runs them all */
+	for (i = 0; i < NR_FIXED_CASES && !wanted(fixed_cases[i]); i++)
+		;
+	if (i == NR_FIXED_CASES)
+		return;
+
+	for (i = 0; i < NR_SESSIONS; i++)
+		fake_session(&cal[i], 1920, 1080);
+
+	t = now();
+	for (i = 0; i < NR_SESSIONS; i++) {
+		if (!calibrate_float(&cal[i]))
+			failed++;
+		memcpy(a[i], cal[i].a, sizeof(a[i]));
+	}
+	report("fixed/calibrate_float", NR_SESSIONS, now() - t, "Msolves/s");
+
+	t = now();
+	for (i = 0; i < NR_SESSIONS; i++)
+		if (!calibrate_fixed(&cal[i]))
+			failed++;
+	report("fixed/calibrate_fixed", NR_SESSIONS, now() - t, "Msolves/s");
+
+	for (i = 0; i < NR_SESSIONS; i++) {
+		calibration_to_matrix(a[i], m);
+		for (y = 0; y < 32768; y += 1024) {
+			for (x = 0; x < 32768; x += 1024) {
+				in[0] = x;
+				in[1] = y;
+				pin[0] = x;
+				pin[1] = y;
+				transform_points_fixed(cal[i].a, in, out, 1);
+				transform_points(m, pin, ref, 1);
+				err = abs(out[0] - (int)(ref[0] + (ref[0] < 0 ? -0.5 : 0.5))) +
+				      abs(out[1] - (int)(ref[1] + (ref[1] < 0 ? -0.5 : 0.5)));
+				if (err > max_err)
+					max_err = err;
+				sum_err += err;
+				n++;
+			}
+		}
+	}
+
+	result("fixed/max_error", max_err, "pixels", NULL, 0);
+	result("fixed/mean_error", sum_err / n, "pixels", NULL, 0);
+	if (failed)
+		result("fixed/failed", failed, "sessions", NULL, 0);
+}
+
+#define NR_DRAWS	4096
+
+static const uint32_t bench_bpp[] = { 8, 16, 24, 32 };
+#define NR_BENCH_BPP (sizeof(bench_bpp) / sizeof(bench_bpp[0]))
+
+static const char *const draw_ops[] = {
+	"line", "put_cross", "show_cross", "put_string",
+};
+#define NR_DRAW_OPS	(sizeof(draw_ops) / sizeof(draw_ops[0]))
+
+static void bench_draw(void)
+{
+	static int coords[NR_DRAWS][4];
+	char name[NR_DRAW_OPS][64];
+	unsigned int i, op;
+	double t;
+	int n, r;
+
+	for (n = 0; n < NR_DRAWS; n++) {
+		coords[n][0] = rand() % 1080;
+		coords[n][1] = rand() % 1080;
+		coords[n][2] = rand() % 1080;
+		coords[n][3] = rand() % 1080;
+	}
+
+	for (i = 0; i < NR_BENCH_BPP; i++) {
+		for (r = 0; r < 4; r++) {
+			for (op = 0; op < NR_DRAW_OPS; op++)
+				sprintf(name[op], "draw/%s/%ubpp/rot%d",
+					draw_ops[op], bench_bpp[i], r);
+			for (op = 0; op < NR_DRAW_OPS && !wanted(name[op]); op++)
+				;
+			if (op == NR_DRAW_OPS)
+				continue;
+
+			if (open_framebuffer_memory(1920, 1080, bench_bpp[i]) < 0)
+				exit(1);
+			set_rotation(r);
+			setcolor(1, 0xffe080);
+			setcolor(2, 0xffffff);
+			setcolor(3, 0xe0c0a0);
+
+			if (wanted(name[0])) {
+				t = now();
+				for (n = 0; n < NR_DRAWS; n++)
+					line(coords[n][0], coords[n][1],
+					     coords[n][2], coords[n][3], 1);
+				report(name[0], NR_DRAWS, now() - t, "Mops/s");
+			}
+
+			if (wanted(name[1])) {
+				t = now();
+				for (n = 0; n < NR_DRAWS; n++)
+					put_cross(coords[n][0], coords[n][1],
+						  2 | XORMODE);
+				report(name[1], NR_DRAWS, now() - t, "Mops/s");
+			}
+
+			if (wanted(name[2])) {
+				t = now();
+				for (n = 0; n < NR_DRAWS; n++)
+					show_cross(coords[n][0], coords[n][1], 2);
+				hide_cross();
+				report(name[2], NR_DRAWS, now() - t, "Mops/s");
+			}
+
+			if (wanted(name[3])) {
+				t = now();
+				for (n = 0; n < NR_DRAWS; n++)
+					put_string(coords[n][0], coords[n][1],
+						   "Touch crosshair to calibrate",
+						   2);
+				report(name[3], NR_DRAWS, now() - t, "Mops/s");
+			}
+
+			close_framebuffer();
+		}
+	}
+}
+
+#define NR_FLUSHES	32
+
+/* Full screen flushes of the shadow buffer, which rotate on the way */
+static void bench_rotate(void)
+{
+	char name[64];
+	unsigned int i;
+	double t;
+	int n, r;
+
+	shadow_buffer = 1;
+	for (i = 0; i < NR_BENCH_BPP; i++) {
+		for (r = 0; r < 4; r++) {
+			sprintf(name, "rotate/flush/%ubpp/rot%d", bench_bpp[i], r);
+			if (!wanted(name))
+				continue;
+
+			if (open_framebuffer_memory(1920, 1080, bench_bpp[i]) < 0)
+				exit(1);
+			set_rotation(r);
+			setcolor(1, 0xffe080);
+
+			t = now();
+			for (n = 0; n < NR_FLUSHES; n++) {
+				/* two corners make the whole screen dirty */
+				pixel(0, 0, 1);
+				pixel(xres - 1, yres - 1, 1);
+				flush_framebuffer();
+			}
+			report(name, (double)NR_FLUSHES * 1920 * 1080, now() - t,
+			       "Mpixels/s");
+
+			close_framebuffer();
+		}
+	}
+	shadow_buffer = 0;
+}
+
+/* fill_bulk() and copy_bulk() against the C library, in and out of cache */
+static void bench_bulk(void)
+{
+	static const size_t sizes[] = { 64 * 1024, 32 * 1024 * 1024 };
+	char name[64];
+	unsigned char *a, *b;
+	unsigned int i, n, rounds;
+	double t;
+
+	a = malloc(sizes[1]);
+	b = malloc(sizes[1]);
+	if (!a || !b)
+		exit(1);
+	memset(b, 0x55, sizes[1]);
+
+	for (i = 0; i < 2; i++) {
+		rounds = sizes[1] / sizes[i] * 4;
+
+		sprintf(name, "bulk/memset/%zuk", sizes[i] / 1024);
+		if (wanted(name)) {
+			t = now();
+			for (n = 0; n < rounds; n++)
+				memset(a, n, sizes[i]);
+			report(name, (double)rounds * sizes[i], now() - t,
+			       "MB/s");
+		}
+
+		sprintf(name, "bulk/fill_bulk/%zuk", sizes[i] / 1024);
+		if (wanted(name)) {
+			t = now();
+			for (n = 0; n < rounds; n++)
+				fill_bulk(a, n * 0x01010101, sizes[i]);
+			report(name, (double)rounds * sizes[i], now() - t,
+			       "MB/s");
+		}
+
+		sprintf(name, "bulk/memcpy/%zuk", sizes[i] / 1024);
+		if (wanted(name)) {
+			t = now();
+			for (n = 0; n < rounds; n++)
+				memcpy(a, b, sizes[i]);
+			report(name, (double)rounds * sizes[i], now() - t,
+			       "MB/s");
+		}
+
+		sprintf(name, "bulk/copy_bulk/%zuk", sizes[i] / 1024);
+		if (wanted(name)) {
+			t = now();
+			for (n = 0; n < rounds; n++)
+				copy_bulk(a, b, sizes[i]);
+			report(name, (double)rounds * sizes[i], now() - t,
+			       "MB/s");
+		}
+	}
+
+	free(a);
+	free(b);
+
+	/* clearing the screen */
+	for (i = 0; i < NR_BENCH_BPP; i++) {
+		sprintf(name, "bulk/fillrect_screen/%ubpp", bench_bpp[i]);
+		if (!wanted(name))
+			continue;
+
+		if (open_framebuffer_memory(3840, 2160, bench_bpp[i]) < 0)
+			exit(1);
+		setcolor(1, 0xffe080);
+
+		t = now();
+		for (n = 0; n < NR_FLUSHES; n++)
+			fillrect(0, 0, xres - 1, yres - 1, 1);
+		report(name, (double)NR_FLUSHES * 3840 * 2160, now() - t,
+		       "Mpixels/s");
+
+		close_framebuffer();
+	}
+}
+
+/* Clearing and flushing an 8K screen on 1 up to all cores */
+static void bench_threads(void)
+{
+	char fill[64], flush[64];
+	long nr_cpus;
+	double t;
+	int n, r;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_cpus < 1)
+		nr_cpus = 1;
+
+	shadow_buffer = 1;
+	for (render_threads = 1; render_threads <= nr_cpus; render_threads++) {
+		for (r = 0; r < 2; r++) {
+			sprintf(fill, "threads/fillrect/rot%d/%d", r,
+				render_threads);
+			sprintf(flush, "threads/flush/rot%d/%d", r,
+				render_threads);
+			if (!wanted(fill) && !wanted(flush))
+				continue;
+
+			if (open_framebuffer_memory(7680, 4320, 32) < 0)
+				exit(1);
+			set_rotation(r);
+			setcolor(1, 0xffe080);
+
+			if (wanted(fill)) {
+				t = now();
+				for (n = 0; n < NR_FLUSHES; n++)
+					fillrect(0, 0, xres - 1, yres - 1, 1);
+				report(fill, (double)NR_FLUSHES * 7680 * 4320,
+				       now() - t, "Mpixels/s");
+			}
+
+			if (wanted(flush)) {
+				t = now();
+				for (n = 0; n < NR_FLUSHES; n++) {
+					pixel(0, 0, 1);
+					pixel(xres - 1, yres - 1, 1);
+					flush_framebuffer();
+				}
+				report(flush, (double)NR_FLUSHES * 7680 * 4320,
+				       now() - t, "Mpixels/s");
+			}
+
+			close_framebuffer();
+		}
+	}
+	render_threads = 0;
+	shadow_buffer = 0;
+}
+
+/* The primitives on screens from QVGA to 8K, timed in batches of calls
+ * that take RENDER_BATCH_S each. A pixel is one a primitive covers: the
+ * line, the outline of a rectangle, all of a filled one, the box of a
+ * cross or of a string.
+ */
+#define NR_RENDER_BATCHES	64
+#define RENDER_BATCH_S		200e-6
+#define RENDER_CROSS_BOX	21
+#define RENDER_STRING		"Touch crosshair to calibrate"
+
+static const uint32_t render_sizes[][2] = {
+	{ 320, 240 }, { 800, 480 }, { 1280, 720 }, { 1920, 1080 },
+	{ 3840, 2160 }, { 7680, 4320 },
+};
+
+static int render_coords[NR_DRAWS][4];
+
+static double __width(const int *c)
+{
+	return abs(c[2] - c[0]) + 1;
+}
+
+static double __height(const int *c)
+{
+	return abs(c[3] - c[1]) + 1;
+}
+
+static double render_pixel(const int *c)
+{
+	pixel(c[0], c[1], 1);
+	return 1;
+}
+
+static double render_line(const int *c)
+{
+	line(c[0], c[1], c[2], c[3], 1);
+	return __width(c) > __height(c) ? __width(c) : __height(c);
+}
+
+static double render_rect(const int *c)
+{
+	rect(c[0], c[1], c[2], c[3], 1);
+	if (__width(c) < 2 || __height(c) < 2)
+		return __width(c) * __height(c);
+	return 2 * (__width(c) + __height(c)) - 4;
+}
+
+static double render_fillrect(const int *c)
+{
+	fillrect(c[0], c[1], c[2], c[3], 3);
+	return __width(c) * __height(c);
+}
+
+static double render_put_cross(const int *c)
+{
+	put_cross(c[0], c[1], 2 | XORMODE);
+	return RENDER_CROSS_BOX * RENDER_CROSS_BOX;
+}
+
+static double render_put_string(const int *c)
+{
+	put_string(c[0], c[1], RENDER_STRING, 2);
+	return (double)(sizeof(RENDER_STRING) - 1) * char_width * char_height;
+}
+
+static const struct {
+	const char *name;
+	/* draw with coordinates c, return the pixels covered */
+	double (*draw)(const int *c);
+} render_ops[] = {
+	{ "pixel", render_pixel },
+	{ "line", render_line },
+	{ "rect", render_rect },
+	{ "fillrect", render_fillrect },
+	{ "put_cross", render_put_cross },
+	{ "put_string", render_put_string },
+};
+
+static void render_case(const char *name, int op)
+{
+	double ns[NR_RENDER_BATCHES];
+	double t, dt, pixels = 0, seconds = 0;
+	int i, n, calls, next = 0;
+
+	/* calls per batch: enough to see with the clock */
+	for (calls = 1; ; calls *= 2) {
+		t = now();
+		for (n = 0; n < calls; n++)
+			render_ops[op].draw(render_coords[(next + n) % NR_DRAWS]);
+		next += calls;
+		if (now() - t >= RENDER_BATCH_S || calls >= 1 << 20)
+			break;
+	}
+
+	for (i = 0; i < NR_RENDER_BATCHES; i++) {
+		t = now();
+		for (n = 0; n < calls; n++, next++)
+			pixels += render_ops[op].draw(render_coords[next % NR_DRAWS]);
+		dt = now() - t;
+		seconds += dt;
+		ns[i] = dt * 1e9 / calls;
+	}
+
+	qsort(ns, NR_RENDER_BATCHES, sizeof(ns[0]), sort_double);
+	result(name, pixels / seconds / 1e6, "Mpixels/s", ns,
+	       NR_RENDER_BATCHES);
+}
+
+static void render_name(char *name, unsigned int op, unsigned int s,
+			unsigned int i, int r)
+{
+	sprintf(name, "render/%s/%ux%u/%ubpp/rot%d", render_ops[op].name,
+		render_sizes[s][0], render_sizes[s][1], bench_bpp[i], r);
+}
+
+#define NR_RENDER_OPS	(sizeof(render_ops) / sizeof(render_ops[0]))
+
+static void bench_render(void)
+{
+	char name[64];
+	unsigned int s, i, op;
+	int n, r;
+
+	for (s = 0; s < sizeof(render_sizes) / sizeof(render_sizes[0]); s++) {
+		for (i = 0; i < NR_BENCH_BPP; i++) {
+			for (r = 0; r < 4; r++) {
+				for (op = 0; op < NR_RENDER_OPS; op++) {
+					render_name(name, op, s, i, r);
+					if (wanted(name))
+						break;
+				}
+				if (op == NR_RENDER_OPS)
+					continue;
+
+				if (open_framebuffer_memory(render_sizes[s][0],
+							    render_sizes[s][1],
+							    bench_bpp[i]) < 0)
+					exit(1);
+				set_rotation(r);
+				setcolor(1, 0xffe080);
+				setcolor(2, 0xffffff);
+				setcolor(3, 0xe0c0a0);
+
+				/* the same for every run */
+				srand(s);
+				for (n = 0; n < NR_DRAWS; n++) {
+					render_coords[n][0] = rand() % xres;
+					render_coords[n][1] = rand() % yres;
+					render_coords[n][2] = rand() % xres;
+					render_coords[n][3] = rand() % yres;
+				}
+
+				for (op = 0; op < NR_RENDER_OPS; op++) {
+					render_name(name, op, s, i, r);
+					if (wanted(name))
+						render_case(name, op);
+				}
+
+				close_framebuffer();
+			}
+		}
+	}
+}
+
+/* position at step n of a pen bouncing between lo and hi */
+static int bounce(int n, int lo, int hi)
+{
+	int span = hi - lo, p = n % (2 * span);
+
+	return lo + (p < span ? p : 2 * span - p);
+}
+
+/* A touch trail on the verification screen: 240 Hz input on a 60 Hz
+ * display, so each frame adds 4 strokes, fades and flushes. The pen zig
+ * zags over the middle of the screen, bouncing off its edges.
+ */
+#define NR_TRAIL_FRAMES		240
+#define TRAIL_STROKES		4
+
+static const uint32_t trail_sizes[][2] = {
+	{ 800, 480 }, { 1920, 1080 }, { 3840, 2160 },
+};
+
+static void bench_trail(void)
+{
+	double ns[NR_TRAIL_FRAMES];
+	double t, dt, seconds;
+	char name[64];
+	unsigned int s, i;
+	int n, k, x, y, lx, ly, step;
+
+	shadow_buffer = 1;
+	for (s = 0; s < sizeof(trail_sizes) / sizeof(trail_sizes[0]); s++) {
+		for (i = 0; i < NR_BENCH_BPP; i++) {
+			sprintf(name, "trail/%ux%u/%ubpp", trail_sizes[s][0],
+				trail_sizes[s][1], bench_bpp[i]);
+			if (!wanted(name))
+				continue;
+
+			if (open_framebuffer_memory(trail_sizes[s][0],
+						    trail_sizes[s][1],
+						    bench_bpp[i]) < 0 ||
+			    overlay_open() < 0)
+				exit(1);
+			setcolor(1, 0xffe080);
+			setcolor(4, 0xff0000);
+			fillrect(0, 0, xres - 1, yres - 1, 1);
+			flush_framebuffer();
+
+			step = xres / 100;
+			lx = xres / 4;
+			ly = yres / 4;
+			seconds = 0;
+			for (n = 0; n < NR_TRAIL_FRAMES; n++) {
+				t = now();
+				for (k = 1; k <= TRAIL_STROKES; k++) {
+					x = bounce((n * TRAIL_STROKES + k) * step,
+						   xres / 4, xres * 3 / 4);
+					y = bounce((n * TRAIL_STROKES + k) * step * 2,
+						   yres / 4, yres * 3 / 4);
+					overlay_line(lx, ly, x, y, 4);
+					lx = x;
+					ly = y;
+				}
+				/* a second to fade out */
+				overlay_fade(4);
+				flush_framebuffer();
+				dt = now() - t;
+				seconds += dt;
+				ns[n] = dt * 1e9;
+			}
+
+			qsort(ns, NR_TRAIL_FRAMES, sizeof(ns[0]), sort_double);
+			result(name, NR_TRAIL_FRAMES / seconds, "frames/s", ns,
+			       NR_TRAIL_FRAMES);
+
+			close_framebuffer();
+		}
+	}
+	shadow_buffer = 0;
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benchmarks[] = {
+	{ "transform", bench_transform },
+	{ "fixed", bench_fixed },
+	{ "draw", bench_draw },
+	{ "rotate", bench_rotate },
+	{ "bulk", bench_bulk },
+	{ "threads", bench_threads },
+	{ "render", bench_render },
+	{ "trail", bench_trail },
+};
+
+#define NR_BENCHMARKS	(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr, "Usage: %s [<benchmark> [<text>]]\n", prog);
+	fprintf(stderr, "Only cases whose names contain text run.\n");
+	fprintf(stderr, "Benchmarks:\n");
+	for (i = 0; i < NR_BENCHMARKS; i++)
+		fprintf(stderr, "  %s\n", benchmarks[i].name);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+
+	if (argc > 3) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (argc > 1) {
+		for (i = 0; i < NR_BENCHMARKS; i++)
+			if (strcmp(argv[1], benchmarks[i].name) == 0)
+				break;
+		if (i == NR_BENCHMARKS) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc > 2)
+		filter = argv[2];
+
+	printf("name,value,unit,p50_ns,p90_ns,p99_ns\n");
+	for (i = 0; i < NR_BENCHMARKS; i++) {
+		if (argc > 1 && strcmp(argv[1], benchmarks[i].name) != 0)
+			continue;
+
+		benchmarks[i].run();
+	}
+
+	return 0;
+}
@@ -6,11 +6,14 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "config.h"
+
 #include "lc.h"
 
 #define HYPATIA_IMPLEMENTATION
@@ -430,30 +433,394 @@ int ts_read_raw(struct tsdev *ts, struct ts_calib_sample *samp, int nr)
 	return result;
 }
 
-int perform_calibration(calibration *cal)
+static int sort_by_x(const void *a, const void *b)
+{
+	return (((struct ts_calib_sample *)a)->x - ((struct ts_calib_sample *)b)->x);
+}
+
+static int sort_by_y(const void *a, const void *b)
+{
+	return (((struct ts_calib_sample *)a)->y - ((struct ts_calib_sample *)b)->y);
+}
+
+/* mean of the sorted samples from first to last, including both */
+static int mean_x(const struct ts_calib_sample *samp, int first, int last)
+{
+	long sum = 0;
+	int i;
+
+	for (i = first; i <= last; i++)
+		sum += samp[i].x;
+
+	return sum / (last - first + 1);
+}
+
+static int mean_y(const struct ts_calib_sample *samp, int first, int last)
+{
+	long sum = 0;
+	int i;
+
+	for (i = first; i <= last; i++)
+		sum += samp[i].y;
+
+	return sum / (last - first + 1);
+}
+
+/* Reduce the index samples of one touch to a single position. The
+ * samples get reordered.
+ */
+void estimate_xy(struct ts_calib_sample *samp, int index, int estimator,
+		 int *x, int *y)
+{
+	int middle, trim;
+
+	if (index <= 0)
+		return;
+
+	switch (estimator) {
+	case ESTIMATOR_MEAN:
+		if (x)
+			*x = mean_x(samp, 0, index - 1);
+		if (y)
+			*y = mean_y(samp, 0, index - 1);
+		return;
+	case ESTIMATOR_TRIMMED_MEAN:
+		/* drop the lowest and highest quarter */
+		trim = index / 4;
+		if (x) {
+			qsort(samp, index, sizeof(struct ts_calib_sample), sort_by_x);
+			*x = mean_x(samp, trim, index - 1 - trim);
+		}
+		if (y) {
+			qsort(samp, index, sizeof(struct ts_calib_sample), sort_by_y);
+			*y = mean_y(samp, trim, index - 1 - trim);
+		}
+		return;
+	case ESTIMATOR_MEDIAN:
+	default:
+		break;
+	}
+
+	/*
+	 * At this point, we have samples in indices zero to (index-1)
+	 * which means that we have (index) number of samples.  We want
+	 * to calculate the median of the samples so that wild outliers
+	 * don't skew the result.  First off, let's assume that arrays
+	 * are one-based instead of zero-based.  If this were the case
+	 * and index was odd, we would need sample number ((index+1)/2)
+	 * of a sorted array; if index was even, we would need the
+	 * average of sample number (index/2) and sample number
+	 * ((index/2)+1).  To turn this into something useful for the
+	 * real world, we just need to subtract one off of the sample
+	 * numbers.  So for when index is odd, we need sample number
+	 * (((index+1)/2)-1).  Due to integer division truncation, we
+	 * can simplify this to just (index/2).  When index is even, we
+	 * need the average of sample number ((index/2)-1) and sample
+	 * number (index/2).  Calculate (index/2) now and we'll handle
+	 * the even odd stuff after we sort.
+	 */
+	middle = index/2;
+	if (x) {
+		qsort(samp, index, sizeof(struct ts_calib_sample), sort_by_x);
+		if (index & 1)
+			*x = samp[middle].x;
+		else
+			*x = (samp[middle-1].x + samp[middle].x) / 2;
+	}
+	if (y) {
+		qsort(samp, index, sizeof(struct ts_calib_sample), sort_by_y);
+		if (index & 1)
+			*y = samp[middle].y;
+		else
+			*y = (samp[middle-1].y + samp[middle].y) / 2;
+	}
+}
+
+/* Compare how the raw samples move between the four corner crosses with
+ * how the crosses move on the screen. A horizontal step on the screen that
+ * mostly changes raw y means the axes are swapped, and a step that makes the
+ * (possibly swapped) raw value smaller means that axis is inverted.
+ */
+int detect_orientation(const calibration *cal)
+{
+	int hx = (cal->x[UR] - cal->x[UL]) + (cal->x[LR] - cal->x[LL]);
+	int hy = (cal->y[UR] - cal->y[UL]) + (cal->y[LR] - cal->y[LL]);
+	int vx = (cal->x[LL] - cal->x[UL]) + (cal->x[LR] - cal->x[UR]);
+	int vy = (cal->y[LL] - cal->y[UL]) + (cal->y[LR] - cal->y[UR]);
+	int orientation = 0;
+	int tmp;
+
+	if (abs(hy) + abs(vx) > abs(hx) + abs(vy)) {
+		orientation |= ORIENT_SWAP_XY;
+		tmp = hx; hx = hy; hy = tmp;
+		tmp = vx; vx = vy; vy = tmp;
+	}
+
+	if (hx < 0)
+		orientation |= ORIENT_INVERT_X;
+	if (vy < 0)
+		orientation |= ORIENT_INVERT_Y;
+
+	return orientation;
+}
+
+static void orient_sample(int orientation, int x, int y, int *xo, int *yo)
 {
-	struct matrix3 coeff_tmp, tmi, tm, ts, coeff;
+	int tmp;
+
+	if (orientation & ORIENT_SWAP_XY) {
+		tmp = x; x = y; y = tmp;
+	}
+	if (orientation & ORIENT_INVERT_X)
+		x = -x;
+	if (orientation & ORIENT_INVERT_Y)
+		y = -y;
+
+	*xo = x;
+	*yo = y;
+}
+
+static int to_fixed(HYP_FLOAT value)
+{
+	value *= 65536;
+
+	return (int)(value < 0 ? value - 0.5 : value + 0.5);
+}
+
+/* plain Newton iteration, we don't link libm */
+double lc_sqrt(double value)
+{
+	double r = value > 1 ? value : 1;
+	int i;
+
+	if (value <= 0)
+		return 0;
+
+	for (i = 0; i < 64; i++)
+		r = (r + value / r) / 2;
+
+	return r;
+}
+
+void rls_init(struct lc_rls *rls)
+{
+	int i;
+
+	memset(rls, 0, sizeof(struct lc_rls));
+	for (i = 0; i < 3; i++)
+		rls->p[i][i] = RLS_DELTA;
+}
+
+/* Feed one more touched point into the running least squares estimate of
+ * xfb = tx . (x, y, 1) and yfb = ty . (x, y, 1). Returns how many pixels the
+ * point is off from what the previous estimate predicted, or -1 if there
+ * were fewer than three points before, so no prediction could be made.
+ */
+double rls_update(struct lc_rls *rls, int x, int y, int xfb, int yfb)
+{
+	const double phi[3] = { x, y, 1 };
+	double u[3], k[3];
+	double denom = 1;
+	double ex = xfb, ey = yfb;
+	double error = -1;
+	int i, j;
+
+	for (i = 0; i < 3; i++) {
+		u[i] = 0;
+		for (j = 0; j < 3; j++)
+			u[i] += rls->p[i][j] * phi[j];
+		denom += phi[i] * u[i];
+		ex -= rls->tx[i] * phi[i];
+		ey -= rls->ty[i] * phi[i];
+	}
+
+	if (rls->n >= 3)
+		error = lc_sqrt(ex * ex + ey * ey);
+
+	for (i = 0; i < 3; i++) {
+		k[i] = u[i] / denom;
+		rls->tx[i] += k[i] * ex;
+		rls->ty[i] += k[i] * ey;
+	}
+
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			rls->p[i][j] -= k[i] * u[j];
+
+	rls->sse += (ex * ex + ey * ey) / denom;
+	rls->n++;
+	rls->residual = lc_sqrt(rls->sse / rls->n);
+
+	return error;
+}
+
+/* provisional matrix in tslib order, see get_sample() */
+int rls_matrix(const struct lc_rls *rls, int *a)
+{
+	if (rls->n < 3)
+		return 0;
+
+	a[0] = to_fixed(rls->tx[2]);
+	a[1] = to_fixed(rls->tx[0]);
+	a[2] = to_fixed(rls->tx[1]);
+	a[3] = to_fixed(rls->ty[2]);
+	a[4] = to_fixed(rls->ty[0]);
+	a[5] = to_fixed(rls->ty[1]);
+	a[6] = 65536;
+
+	return 1;
+}
+
+/* Solve for UL, UR and LL using hypatia, in the orientation of the screen.
+ * cal->orientation has to be set already.
+ */
+int calibrate_float(calibration *cal)
+{
+	struct matrix3 tmi, tm, ts, coeff, orient;
 	const float xl = cal->xfb[0];
 	const float xr = cal->xfb[1];
 	const float yu = cal->yfb[0];
 	const float yl = cal->yfb[3];
+	int x[NUM_POINTS], y[NUM_POINTS];
+	int i;
+
+	/* fit in the orientation of the screen */
+	for (i = 0; i < NUM_POINTS; i++)
+		orient_sample(cal->orientation, cal->x[i], cal->y[i],
+			      &x[i], &y[i]);
 
 	/* skip LR */
-	tm.c00 = cal->x[UL];	tm.c10 = cal->x[UR];	tm.c20 = cal->x[LL];
-	tm.c01 = cal->y[UL];	tm.c11 = cal->y[UR];	tm.c21 = cal->y[LL];
+	tm.c00 = x[UL];		tm.c10 = x[UR];		tm.c20 = x[LL];
+	tm.c01 = y[UL];		tm.c11 = y[UR];		tm.c21 = y[LL];
 	tm.c02 = 1;		tm.c12 = 1;		tm.c22 = 1;
 
 	ts.c00 = xl;		ts.c10 = xr;		ts.c20 = xl;
 	ts.c01 = yu;		ts.c11 = yu;		ts.c21 = yl;
 	ts.c02 = 1;		ts.c12 = 1;		ts.c22 = 1;
 
-	matrix3_set(&tmi, &tm);
-	matrix3_invert(&tmi);
+	if (!matrix3_inverse(&tm, &tmi))
+		return 0;
 
-	matrix3_set(&coeff, &ts);
-	printf("verify c00 changes before multiply: %f\n", coeff.c00);
-	matrix3_multiply(&coeff, &tmi);
-	printf("verify c00 changes after multiply: %f\n", coeff.c00);
+	/* coeff = ts * tm^-1 */
+	matrix3_set(&coeff, &tmi);
+	matrix3_multiply(&coeff, &ts);
 
-	/* skip UL*/
+	/* fold the orientation back in: coeff = coeff * orient */
+	matrix3_zero(&orient);
+	if (cal->orientation & ORIENT_SWAP_XY) {
+		orient.r01 = 1;
+		orient.r10 = 1;
+	} else {
+		orient.r00 = 1;
+		orient.r11 = 1;
+	}
+	if (cal->orientation & ORIENT_INVERT_X) {
+		orient.r00 = -orient.r00;
+		orient.r01 = -orient.r01;
+	}
+	if (cal->orientation & ORIENT_INVERT_Y) {
+		orient.r10 = -orient.r10;
+		orient.r11 = -orient.r11;
+	}
+	orient.r22 = 1;
+	matrix3_multiply(&orient, &coeff);
+
+	/* tslib order: xfb = (a0 + a1 * x + a2 * y) / a6 */
+	cal->a[0] = to_fixed(orient.r02);
+	cal->a[1] = to_fixed(orient.r00);
+	cal->a[2] = to_fixed(orient.r01);
+	cal->a[3] = to_fixed(orient.r12);
+	cal->a[4] = to_fixed(orient.r10);
+	cal->a[5] = to_fixed(orient.r11);
+	cal->a[6] = 65536;
+
+	return 1;
+}
+
+static int64_t div_round(int64_t n, int64_t d)
+{
+	if (d < 0) {
+		n = -n;
+		d = -d;
+	}
+
+	return n < 0 ? -((-n + d / 2) / d) : (n + d / 2) / d;
+}
+
+/* Same as calibrate_float() but in integers only, for boards without an
+ * FPU. Cramer's rule gives the Q16.16 constants directly. With raw values
+ * below 2^15 and framebuffer coordinates below 2^13 the largest numerator,
+ * the one for the offset, stays below 2^61.
+ */
+int calibrate_fixed(calibration *cal)
+{
+	static const int idx[3] = { UL, UR, LL };
+	int64_t x[3], y[3], det;
+	int64_t ax, ay, c, tmp;
+	int64_t t[3];
+	int i, xo, yo, axis;
+
+	for (i = 0; i < 3; i++) {
+		orient_sample(cal->orientation, cal->x[idx[i]], cal->y[idx[i]],
+			      &xo, &yo);
+		x[i] = xo;
+		y[i] = yo;
+	}
+
+	det = x[0] * (y[1] - y[2]) - y[0] * (x[1] - x[2]) +
+	      (x[1] * y[2] - x[2] * y[1]);
+	if (det == 0)
+		return 0;
+
+	for (axis = 0; axis < 2; axis++) {
+		for (i = 0; i < 3; i++)
+			t[i] = axis ? cal->yfb[idx[i]] : cal->xfb[idx[i]];
+
+		ax = t[0] * (y[1] - y[2]) + t[1] * (y[2] - y[0]) +
+		     t[2] * (y[0] - y[1]);
+		ay = t[0] * (x[2] - x[1]) + t[1] * (x[0] - x[2]) +
+		     t[2] * (x[1] - x[0]);
+		c = t[0] * (x[1] * y[2] - x[2] * y[1]) +
+		    t[1] * (x[2] * y[0] - x[0] * y[2]) +
+		    t[2] * (x[0] * y[1] - x[1] * y[0]);
+
+		ax = div_round(ax * 65536, det);
+		ay = div_round(ay * 65536, det);
+		c = div_round(c * 65536, det);
+
+		/* fold the orientation back in */
+		if (cal->orientation & ORIENT_INVERT_X)
+			ax = -ax;
+		if (cal->orientation & ORIENT_INVERT_Y)
+			ay = -ay;
+		if (cal->orientation & ORIENT_SWAP_XY) {
+			tmp = ax; ax = ay; ay = tmp;
+		}
+
+		cal->a[3 * axis] = c;
+		cal->a[3 * axis + 1] = ax;
+		cal->a[3 * axis + 2] = ay;
+	}
+	cal->a[6] = 65536;
+
+	return 1;
+}
+
+int perform_calibration(calibration *cal)
+{
+	cal->orientation = detect_orientation(cal);
+	printf("Touchscreen orientation:%s%s%s%s\n",
+	       cal->orientation ? "" : " normal",
+	       (cal->orientation & ORIENT_SWAP_XY) ? " swapped-xy" : "",
+	       (cal->orientation & ORIENT_INVERT_X) ? " inverted-x" : "",
+	       (cal->orientation & ORIENT_INVERT_Y) ? " inverted-y" : "");
+
+	/* the same model either way, the running least squares fit only
+	 * gives the provisional constants and flags outliers
+	 */
+#ifdef LC_FIXED_POINT
+	return calibrate_fixed(cal);
+#else
+	return calibrate_float(cal);
+#endif
 }
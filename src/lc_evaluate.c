@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * Offline evaluation of recorded sessions (see --record). Every session is
+ * re-run with each combination of sample limit, estimator and model, and the
+ * resulting matrix is checked against the known target positions. Sessions
+ * are spread over one thread per CPU.
+ *
+ * A session file looks like this, one raw sample per line after each target:
+ *
+ *   screen 800 480
+ *   target 100 60
+ *   1021 733
+ *   ...
+ *
+ * The first four targets are UL, UR, LR and LL and are used for fitting.
+ * Any further targets are only used for checking. Without those, the error
+ * is measured at the four calibration targets.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "lc.h"
+
+enum {
+	MODEL_3POINT = 0,
+	MODEL_LEAST_SQUARES,
+	MODEL_FIXED,
+	NR_MODELS
+};
+
+static const char * const model_names[NR_MODELS] = {
+	"3point", "lsq", "fixed"
+};
+
+static const char * const estimator_names[NR_ESTIMATORS] = {
+	"median", "mean", "trimmed"
+};
+
+/* MAX_SAMPLES candidates, getxy() uses 128 */
+static const int sample_limits[] = { 4, 8, 16, 32, 64, 128 };
+#define NR_LIMITS (sizeof(sample_limits) / sizeof(sample_limits[0]))
+
+#define NR_CONFIGS (NR_LIMITS * NR_ESTIMATORS * NR_MODELS)
+
+struct eval_target {
+	int xfb, yfb;
+	int nr;
+	int *xy;
+};
+
+struct eval_session {
+	const char *path;
+	int nr_targets;
+	struct eval_target *targets;
+
+	/* squared error in pixels per config and checked target */
+	double *errors;
+	int nr_checked;
+	int failed[NR_CONFIGS];
+};
+
+struct eval_job {
+	struct eval_session *sessions;
+	int nr;
+	int next;
+};
+
+static int add_sample(struct eval_target *t, int x, int y)
+{
+	int *xy;
+
+	if ((t->nr & 63) == 0) {
+		xy = realloc(t->xy, (t->nr + 64) * 2 * sizeof(int));
+		if (!xy)
+			return -1;
+		t->xy = xy;
+	}
+	t->xy[2 * t->nr] = x;
+	t->xy[2 * t->nr + 1] = y;
+	t->nr++;
+
+	return 0;
+}
+
+static int load_session(struct eval_session *s, const char *path)
+{
+	struct eval_target *t = NULL;
+	char line[128];
+	int a, b, ret = 0;
+	FILE *f;
+
+	memset(s, 0, sizeof(*s));
+	s->path = path;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || strncmp(line, "screen", 6) == 0)
+			continue;
+
+		if (sscanf(line, "target %d %d", &a, &b) == 2) {
+			t = realloc(s->targets,
+				    (s->nr_targets + 1) * sizeof(*t));
+			if (!t) {
+				ret = -1;
+				break;
+			}
+			s->targets = t;
+			t = &s->targets[s->nr_targets++];
+			memset(t, 0, sizeof(*t));
+			t->xfb = a;
+			t->yfb = b;
+		} else if (t && sscanf(line, "%d %d", &a, &b) == 2) {
+			if (add_sample(t, a, b) < 0) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+	fclose(f);
+
+	if (ret == 0 && s->nr_targets < NUM_POINTS) {
+		fprintf(stderr, "%s: only %d targets\n", path, s->nr_targets);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static void free_session(struct eval_session *s)
+{
+	int i;
+
+	for (i = 0; i < s->nr_targets; i++)
+		free(s->targets[i].xy);
+	free(s->targets);
+	free(s->errors);
+}
+
+static void estimate_target(const struct eval_target *t, int limit,
+			    int estimator, int *x, int *y)
+{
+	struct ts_calib_sample samp[128];
+	int i, nr = t->nr < limit ? t->nr : limit;
+
+	for (i = 0; i < nr; i++) {
+		samp[i].x = t->xy[2 * i];
+		samp[i].y = t->xy[2 * i + 1];
+	}
+	*x = 0;
+	*y = 0;
+	estimate_xy(samp, nr, estimator, x, y);
+}
+
+static int fit(calibration *cal, int model)
+{
+	int i;
+
+	cal->orientation = detect_orientation(cal);
+
+	switch (model) {
+	case MODEL_LEAST_SQUARES:
+		rls_init(&cal->rls);
+		for (i = 0; i < NUM_POINTS; i++)
+			rls_update(&cal->rls, cal->x[i], cal->y[i],
+				   cal->xfb[i], cal->yfb[i]);
+		return rls_matrix(&cal->rls, cal->a);
+	case MODEL_FIXED:
+		return calibrate_fixed(cal);
+	case MODEL_3POINT:
+	default:
+		return calibrate_float(cal);
+	}
+}
+
+static void evaluate_session(struct eval_session *s)
+{
+	const int first = s->nr_targets > NUM_POINTS ? NUM_POINTS : 0;
+	struct eval_target *t;
+	calibration cal;
+	unsigned int limit, estimator, model, config;
+	int i, x, y;
+	double dx, dy, *err;
+
+	s->nr_checked = s->nr_targets - first;
+	s->errors = malloc(NR_CONFIGS * s->nr_checked * sizeof(double));
+	if (!s->errors) {
+		s->nr_checked = 0;
+		return;
+	}
+
+	for (limit = 0; limit < NR_LIMITS; limit++) {
+		for (estimator = 0; estimator < NR_ESTIMATORS; estimator++) {
+			memset(&cal, 0, sizeof(cal));
+			for (i = 0; i < NUM_POINTS; i++) {
+				t = &s->targets[i];
+				estimate_target(t, sample_limits[limit],
+						estimator, &cal.x[i], &cal.y[i]);
+				cal.xfb[i] = t->xfb;
+				cal.yfb[i] = t->yfb;
+			}
+
+			for (model = 0; model < NR_MODELS; model++) {
+				config = (limit * NR_ESTIMATORS + estimator) *
+					 NR_MODELS + model;
+				err = &s->errors[config * s->nr_checked];
+
+				if (!fit(&cal, model)) {
+					s->failed[config] = 1;
+					continue;
+				}
+
+				for (i = 0; i < s->nr_checked; i++) {
+					t = &s->targets[first + i];
+					estimate_target(t, sample_limits[limit],
+							estimator, &x, &y);
+					dx = (cal.a[0] + (double)cal.a[1] * x +
+					      (double)cal.a[2] * y) / cal.a[6] - t->xfb;
+					dy = (cal.a[3] + (double)cal.a[4] * x +
+					      (double)cal.a[5] * y) / cal.a[6] - t->yfb;
+					err[i] = dx * dx + dy * dy;
+				}
+			}
+		}
+	}
+}
+
+static void *evaluate_thread(void *arg)
+{
+	struct eval_job *job = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nr)
+		evaluate_session(&job->sessions[i]);
+
+	return NULL;
+}
+
+static int sort_by_error(const void *a, const void *b)
+{
+	double ea = *(const double *)a, eb = *(const double *)b;
+
+	return (ea > eb) - (ea < eb);
+}
+
+static double percentile(const double *sorted, int nr, int p)
+{
+	return lc_sqrt(sorted[(nr - 1) * p / 100]);
+}
+
+static void report(struct eval_session *sessions, int nr)
+{
+	unsigned int config;
+	double *all, mean;
+	int i, j, n, failed;
+
+	for (i = 0, n = 0; i < nr; i++)
+		n += sessions[i].nr_checked;
+
+	all = malloc((n ? n : 1) * sizeof(double));
+	if (!all) {
+		perror("malloc");
+		return;
+	}
+
+	printf("%-8s %-8s %-8s %8s %6s %8s %8s %8s %8s %8s\n",
+	       "samples", "estim", "model", "points", "failed",
+	       "mean", "p50", "p90", "p99", "max");
+
+	for (config = 0; config < NR_CONFIGS; config++) {
+		n = 0;
+		failed = 0;
+		mean = 0;
+		for (i = 0; i < nr; i++) {
+			if (sessions[i].failed[config]) {
+				failed++;
+				continue;
+			}
+			for (j = 0; j < sessions[i].nr_checked; j++) {
+				all[n] = sessions[i].errors[config * sessions[i].nr_checked + j];
+				mean += lc_sqrt(all[n]);
+				n++;
+			}
+		}
+
+		printf("%-8d %-8s %-8s %8d %6d ",
+		       sample_limits[config / (NR_ESTIMATORS * NR_MODELS)],
+		       estimator_names[config / NR_MODELS % NR_ESTIMATORS],
+		       model_names[config % NR_MODELS], n, failed);
+		if (n == 0) {
+			printf("%8s %8s %8s %8s %8s\n", "-", "-", "-", "-", "-");
+			continue;
+		}
+
+		qsort(all, n, sizeof(double), sort_by_error);
+		printf("%8.2f %8.2f %8.2f %8.2f %8.2f\n", mean / n,
+		       percentile(all, n, 50), percentile(all, n, 90),
+		       percentile(all, n, 99), percentile(all, n, 100));
+	}
+
+	free(all);
+}
+
+int evaluate_sessions(int nr, char **paths)
+{
+	struct eval_session *sessions;
+	struct eval_job job;
+	pthread_t *threads;
+	long nr_threads;
+	int i, loaded = 0;
+
+	if (nr <= 0) {
+		fprintf(stderr, "No session files given\n");
+		return -1;
+	}
+
+	sessions = calloc(nr, sizeof(*sessions));
+	if (!sessions) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (load_session(&sessions[loaded], paths[i]) < 0) {
+			free_session(&sessions[loaded]);
+			continue;
+		}
+		loaded++;
+	}
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > loaded)
+		nr_threads = loaded ? loaded : 1;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		free(sessions);
+		return -1;
+	}
+
+	job.sessions = sessions;
+	job.nr = loaded;
+	job.next = 0;
+
+	printf("Evaluating %d sessions on %ld threads\n", loaded, nr_threads);
+
+	for (i = 0; i < nr_threads; i++) {
+		errno = pthread_create(&threads[i], NULL, evaluate_thread, &job);
+		if (errno) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	/* whatever did not start gets done right here */
+	if (i == 0)
+		evaluate_thread(&job);
+	while (i--)
+		pthread_join(threads[i], NULL);
+
+	report(sessions, loaded);
+
+	for (i = 0; i < loaded; i++)
+		free_session(&sessions[i]);
+	free(sessions);
+	free(threads);
+
+	return loaded ? 0 : -1;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * Apply a calibration matrix to many raw points at once. This is what
+ * offline tooling wants when re-evaluating matrices against recorded
+ * touches; the interactive tool only ever needs a handful of points.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lc.h"
+
+#if !defined(LC_NO_SIMD) && defined(__SSE__)
+# include <xmmintrin.h>
+# define HAVE_SSE_KERNEL
+#elif !defined(LC_NO_SIMD) && defined(__ARM_NEON)
+# include <arm_neon.h>
+# define HAVE_NEON_KERNEL
+#endif
+
+void calibration_to_matrix(const int *a, float *m)
+{
+	const float div = a[6];
+
+	m[0] = a[1] / div;
+	m[1] = a[2] / div;
+	m[2] = a[0] / div;
+	m[3] = a[4] / div;
+	m[4] = a[5] / div;
+	m[5] = a[3] / div;
+}
+
+static void transform_points_scalar(const float *m, const float *in,
+				    float *out, size_t n)
+{
+	float x, y;
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 2, out += 2) {
+		x = in[0];
+		y = in[1];
+		out[0] = m[0] * x + m[1] * y + m[2];
+		out[1] = m[3] * x + m[4] * y + m[5];
+	}
+}
+
+#ifdef HAVE_SSE_KERNEL
+/* two interleaved points per register: x0 y0 x1 y1 */
+static size_t transform_points_sse(const float *m, const float *in,
+				   float *out, size_t n)
+{
+	const __m128 mx = _mm_setr_ps(m[0], m[3], m[0], m[3]);
+	const __m128 my = _mm_setr_ps(m[1], m[4], m[1], m[4]);
+	const __m128 mc = _mm_setr_ps(m[2], m[5], m[2], m[5]);
+	__m128 v0, v1;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4, in += 8, out += 8) {
+		v0 = _mm_loadu_ps(in);
+		v1 = _mm_loadu_ps(in + 4);
+
+		v0 = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_shuffle_ps(v0, v0, _MM_SHUFFLE(2, 2, 0, 0)), mx),
+			_mm_mul_ps(_mm_shuffle_ps(v0, v0, _MM_SHUFFLE(3, 3, 1, 1)), my)),
+			mc);
+		v1 = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_shuffle_ps(v1, v1, _MM_SHUFFLE(2, 2, 0, 0)), mx),
+			_mm_mul_ps(_mm_shuffle_ps(v1, v1, _MM_SHUFFLE(3, 3, 1, 1)), my)),
+			mc);
+
+		_mm_storeu_ps(out, v0);
+		_mm_storeu_ps(out + 4, v1);
+	}
+
+	return i;
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+/* vld2q deinterleaves four points into x and y lanes */
+static size_t transform_points_neon(const float *m, const float *in,
+				    float *out, size_t n)
+{
+	float32x4x2_t v, r;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4, in += 8, out += 8) {
+		v = vld2q_f32(in);
+		r.val[0] = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(m[2]),
+						   v.val[0], m[0]),
+				       v.val[1], m[1]);
+		r.val[1] = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(m[5]),
+						   v.val[0], m[3]),
+				       v.val[1], m[4]);
+		vst2q_f32(out, r);
+	}
+
+	return i;
+}
+#endif
+
+/* in and out hold n interleaved (x, y) pairs and may be the same buffer */
+void transform_points(const float *m, const float *in, float *out, size_t n)
+{
+	size_t done = 0;
+
+#if defined(HAVE_SSE_KERNEL)
+	done = transform_points_sse(m, in, out, n);
+#elif defined(HAVE_NEON_KERNEL)
+	done = transform_points_neon(m, in, out, n);
+#endif
+	transform_points_scalar(m, in + 2 * done, out + 2 * done, n - done);
+}
+
+/* Integer version for boards without an FPU. a is cal->a as filled in by
+ * calibrate_fixed(), so a[6] is 65536 and the sums fit into 64 bits.
+ */
+void transform_points_fixed(const int *a, const int *in, int *out, size_t n)
+{
+	int64_t x, y;
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 2, out += 2) {
+		x = in[0];
+		y = in[1];
+		out[0] = (a[0] + a[1] * x + a[2] * y + 32768) >> 16;
+		out[1] = (a[3] + a[4] * x + a[5] * y + 32768) >> 16;
+	}
+}
@@ -0,0 +1,747 @@
+/*
+ * Copyright (C) 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * "make check": the KMS backend against a made up device, much like vkms:
+ * one connector with a preferred 640x480 mode, one CRTC that fbcon shows
+ * a framebuffer of its own on, and a primary, a cursor and an overlay
+ * plane. It is linked with --wrap for open, close, ioctl, mmap, munmap and
+ * read, __read_chk with _FORTIFY_SOURCE, so that fbutils-drm.c talks to
+ * it instead of /dev/dri. The device refuses what the kernel refuses:
+ * atomic calls without the client cap, properties an object doesn't have,
+ * a modeset without ALLOW_MODESET, a second flip before the first
+ * completed, removing the framebuffer on screen. Drawing goes through the
+ * atomic and the legacy interface, and the legacy one after an atomic
+ * modeset failed, each single and double buffered. The last frame must be
+ * on screen, and after closing fbcon's framebuffer must be back, with
+ * nothing of ours left behind.
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "config.h"
+
+#ifdef HAVE_DRM_DRM_MODE_H
+# include <drm/drm.h>
+# include <drm/drm_mode.h>
+# include <drm/drm_fourcc.h>
+#else
+# include "drm-uapi.h"
+#endif
+
+#include "fbutils.h"
+
+#define DEVICE		"/dev/dri/test_drm"
+#define DEVICE_FD	1000
+
+#define CONNECTOR	31
+#define ENCODER		32
+#define CRTC		33
+#define PRIMARY		34
+#define CURSOR		35
+#define OVERLAY		36
+#define FBCON_FB	77
+#define NR_FBS		4
+#define MAP_OFFSET	0x10000
+
+enum {
+	PROP_CONNECTOR_CRTC_ID = 100,
+	PROP_MODE_ID,
+	PROP_ACTIVE,
+	PROP_FB_ID,		/* plane properties, FB_ID to CRTC_H */
+	PROP_CRTC_ID,
+	PROP_SRC_X,
+	PROP_SRC_Y,
+	PROP_SRC_W,
+	PROP_SRC_H,
+	PROP_CRTC_X,
+	PROP_CRTC_Y,
+	PROP_CRTC_W,
+	PROP_CRTC_H,
+	PROP_TYPE,
+	PROP_DPMS,
+};
+
+static const char * const prop_names[] = {
+	"CRTC_ID", "MODE_ID", "ACTIVE", "FB_ID", "CRTC_ID", "SRC_X", "SRC_Y",
+	"SRC_W", "SRC_H", "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "type",
+	"DPMS",
+};
+
+/* how the device behaves */
+enum {
+	DEVICE_ATOMIC,
+	DEVICE_LEGACY,		/* no atomic client cap */
+	DEVICE_NO_MODESET,	/* atomic, but modesets fail */
+	NR_DEVICES
+};
+
+static const char * const device_names[] = {
+	"atomic", "legacy", "atomic modeset refused",
+};
+
+static struct {
+	int type;
+	int8_t atomic_cap;
+	struct drm_mode_modeinfo modes[2];
+
+	unsigned char *mem;
+	uint64_t size;
+	uint32_t handle, pitch;
+	struct {
+		uint32_t id, offset;
+		int8_t used;
+	} fbs[NR_FBS];
+	uint32_t nr_blobs, mode_blob;
+
+	uint32_t shown_fb;
+	int8_t active, flip_pending;
+	uint64_t src_w, src_h;
+
+	int nr_flips, nr_commits, errors;
+} dev;
+
+/* the device says no, as the kernel would, and the test fails */
+#define REFUSE(...)							\
+	do {								\
+		fprintf(stderr, "device: " __VA_ARGS__);		\
+		fputc('\n', stderr);					\
+		dev.errors++;						\
+		errno = EINVAL;						\
+		return -1;						\
+	} while (0)
+
+static void device_reset(int type)
+{
+	memset(&dev, 0, sizeof(dev));
+	dev.type = type;
+	dev.shown_fb = FBCON_FB;
+	dev.active = 1;
+
+	dev.modes[0].hdisplay = 1024;
+	dev.modes[0].vdisplay = 768;
+	dev.modes[0].clock = 65000;
+	dev.modes[0].vrefresh = 60;
+	strcpy(dev.modes[0].name, "1024x768");
+	dev.modes[1].hdisplay = 640;
+	dev.modes[1].vdisplay = 480;
+	dev.modes[1].clock = 25175;
+	dev.modes[1].vrefresh = 60;
+	dev.modes[1].type = DRM_MODE_TYPE_PREFERRED;
+	strcpy(dev.modes[1].name, "640x480");
+}
+
+static int fb_exists(uint64_t id)
+{
+	int i;
+
+	if (id == FBCON_FB)
+		return 1;
+	for (i = 0; i < NR_FBS; i++)
+		if (dev.fbs[i].used && dev.fbs[i].id == id)
+			return 1;
+	return 0;
+}
+
+/* properties of an object and their values, the number of them */
+static int object_properties(uint32_t obj, uint32_t *ids, uint64_t *values)
+{
+	int n = 0, id;
+
+#define ADD(prop, value)						\
+	do {								\
+		if (ids) {						\
+			ids[n] = prop;					\
+			values[n] = value;				\
+		}							\
+		n++;							\
+	} while (0)
+
+	switch (obj) {
+	case CONNECTOR:
+		ADD(PROP_DPMS, 0);
+		if (dev.atomic_cap)
+			ADD(PROP_CONNECTOR_CRTC_ID, CRTC);
+		break;
+	case CRTC:
+		if (dev.atomic_cap) {
+			ADD(PROP_ACTIVE, dev.active);
+			ADD(PROP_MODE_ID, dev.mode_blob);
+		}
+		break;
+	case PRIMARY:
+	case CURSOR:
+	case OVERLAY:
+		ADD(PROP_TYPE, obj == PRIMARY ? DRM_PLANE_TYPE_PRIMARY :
+			       obj == CURSOR ? 2 : 0);
+		if (!dev.atomic_cap)
+			break;
+		for (id = PROP_FB_ID; id <= PROP_CRTC_H; id++)
+			ADD(id, id == PROP_FB_ID && obj == PRIMARY ?
+				dev.shown_fb : 0);
+		break;
+	}
+#undef ADD
+
+	return n;
+}
+
+static int has_property(uint32_t obj, uint32_t prop)
+{
+	uint32_t ids[32];
+	uint64_t values[32];
+	int i, n = object_properties(obj, ids, values);
+
+	for (i = 0; i < n; i++)
+		if (ids[i] == prop)
+			return 1;
+	return 0;
+}
+
+static int device_atomic(struct drm_mode_atomic *a)
+{
+	const uint32_t *objs = (uint32_t *)(uintptr_t)a->objs_ptr;
+	const uint32_t *counts = (uint32_t *)(uintptr_t)a->count_props_ptr;
+	const uint32_t *props = (uint32_t *)(uintptr_t)a->props_ptr;
+	const uint64_t *values = (uint64_t *)(uintptr_t)a->prop_values_ptr;
+	uint32_t i, j, k = 0, fb = dev.shown_fb, blob = dev.mode_blob;
+	int modeset = 0, active = dev.active;
+
+	if (!dev.atomic_cap)
+		REFUSE("atomic commit without the atomic client cap");
+	if (dev.type == DEVICE_NO_MODESET &&
+	    (a->flags & DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (dev.flip_pending && (a->flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	for (i = 0; i < a->count_objs; i++) {
+		for (j = 0; j < counts[i]; j++, k++) {
+			if (!has_property(objs[i], props[k]))
+				REFUSE("object %u has no property %u",
+				       objs[i], props[k]);
+			switch (props[k]) {
+			case PROP_MODE_ID:
+				if (values[k] != blob)
+					modeset = 1;
+				blob = values[k];
+				break;
+			case PROP_ACTIVE:
+				if ((int)values[k] != active)
+					modeset = 1;
+				active = values[k];
+				break;
+			case PROP_CONNECTOR_CRTC_ID:
+				if (values[k] != CRTC)
+					REFUSE("connector on CRTC %lu",
+					       (unsigned long)values[k]);
+				break;
+			case PROP_FB_ID:
+				if (!fb_exists(values[k]))
+					REFUSE("no framebuffer %lu",
+					       (unsigned long)values[k]);
+				fb = values[k];
+				break;
+			case PROP_SRC_W:
+				dev.src_w = values[k];
+				break;
+			case PROP_SRC_H:
+				dev.src_h = values[k];
+				break;
+			}
+		}
+	}
+
+	if (modeset && !(a->flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+		REFUSE("modeset without ALLOW_MODESET");
+	if (dev.src_w >> 16 != dev.modes[1].hdisplay ||
+	    dev.src_h >> 16 != dev.modes[1].vdisplay)
+		REFUSE("plane source %lux%lu",
+		       (unsigned long)(dev.src_w >> 16),
+		       (unsigned long)(dev.src_h >> 16));
+
+	dev.mode_blob = blob;
+	dev.active = active;
+	dev.shown_fb = fb;
+	dev.nr_commits++;
+	if (a->flags & DRM_MODE_PAGE_FLIP_EVENT) {
+		dev.flip_pending = 1;
+		dev.nr_flips++;
+	}
+
+	return 0;
+}
+
+static int device_ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_GET_CAP: {
+		struct drm_get_cap *cap = arg;
+
+		cap->value = cap->capability == DRM_CAP_DUMB_BUFFER;
+		return 0;
+	}
+	case DRM_IOCTL_SET_CLIENT_CAP: {
+		struct drm_set_client_cap *cap = arg;
+
+		if (cap->capability != DRM_CLIENT_CAP_ATOMIC ||
+		    dev.type == DEVICE_LEGACY) {
+			errno = EINVAL;
+			return -1;
+		}
+		dev.atomic_cap = cap->value != 0;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETRESOURCES: {
+		struct drm_mode_card_res *res = arg;
+
+		if (res->count_crtcs >= 1 && res->crtc_id_ptr)
+			*(uint32_t *)(uintptr_t)res->crtc_id_ptr = CRTC;
+		if (res->count_connectors >= 1 && res->connector_id_ptr)
+			*(uint32_t *)(uintptr_t)res->connector_id_ptr = CONNECTOR;
+		if (res->count_encoders >= 1 && res->encoder_id_ptr)
+			*(uint32_t *)(uintptr_t)res->encoder_id_ptr = ENCODER;
+		if (res->count_fbs >= 1 && res->fb_id_ptr)
+			*(uint32_t *)(uintptr_t)res->fb_id_ptr = FBCON_FB;
+		res->count_crtcs = 1;
+		res->count_connectors = 1;
+		res->count_encoders = 1;
+		res->count_fbs = 1;
+		res->max_width = 8192;
+		res->max_height = 8192;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETCONNECTOR: {
+		struct drm_mode_get_connector *conn = arg;
+
+		if (conn->connector_id != CONNECTOR) {
+			errno = ENOENT;
+			return -1;
+		}
+		if (conn->count_modes >= 2 && conn->modes_ptr)
+			memcpy((void *)(uintptr_t)conn->modes_ptr, dev.modes,
+			       sizeof(dev.modes));
+		if (conn->count_encoders >= 1 && conn->encoders_ptr)
+			*(uint32_t *)(uintptr_t)conn->encoders_ptr = ENCODER;
+		if (conn->count_props >= 1 && conn->props_ptr)
+			REFUSE("connector properties are not asked for");
+		conn->count_modes = 2;
+		conn->count_encoders = 1;
+		conn->count_props = object_properties(CONNECTOR, NULL, NULL);
+		conn->encoder_id = ENCODER;
+		conn->connection = DRM_MODE_CONNECTED;
+		conn->mm_width = 300;
+		conn->mm_height = 225;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETENCODER: {
+		struct drm_mode_get_encoder *enc = arg;
+
+		if (enc->encoder_id != ENCODER) {
+			errno = ENOENT;
+			return -1;
+		}
+		enc->crtc_id = CRTC;
+		enc->possible_crtcs = 1;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETCRTC: {
+		struct drm_mode_crtc *crtc = arg;
+
+		if (crtc->crtc_id != CRTC) {
+			errno = ENOENT;
+			return -1;
+		}
+		crtc->fb_id = FBCON_FB;
+		crtc->mode = dev.modes[0];
+		crtc->mode_valid = 1;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETPLANERESOURCES: {
+		struct drm_mode_get_plane_res *res = arg;
+		/* universal planes come with the atomic cap */
+		const uint32_t all[] = { PRIMARY, CURSOR, OVERLAY };
+		const uint32_t overlay[] = { OVERLAY };
+		uint32_t n = dev.atomic_cap ? 3 : 1;
+
+		if (res->count_planes >= n && res->plane_id_ptr)
+			memcpy((void *)(uintptr_t)res->plane_id_ptr,
+			       dev.atomic_cap ? all : overlay, n * 4);
+		res->count_planes = n;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETPLANE: {
+		struct drm_mode_get_plane *plane = arg;
+
+		if (plane->plane_id < PRIMARY || plane->plane_id > OVERLAY) {
+			errno = ENOENT;
+			return -1;
+		}
+		plane->possible_crtcs = 1;
+		plane->crtc_id = plane->plane_id == PRIMARY ? CRTC : 0;
+		plane->fb_id = plane->plane_id == PRIMARY ? dev.shown_fb : 0;
+		plane->count_format_types = 0;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_OBJ_GETPROPERTIES: {
+		struct drm_mode_obj_get_properties *op = arg;
+		uint32_t ids[32];
+		uint64_t values[32];
+		uint32_t n = object_properties(op->obj_id, ids, values);
+
+		if (op->count_props >= n && op->props_ptr) {
+			memcpy((void *)(uintptr_t)op->props_ptr, ids, n * 4);
+			memcpy((void *)(uintptr_t)op->prop_values_ptr, values,
+			       n * 8);
+		}
+		op->count_props = n;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETPROPERTY: {
+		struct drm_mode_get_property *p = arg;
+
+		if (p->prop_id < PROP_CONNECTOR_CRTC_ID ||
+		    p->prop_id > PROP_DPMS) {
+			errno = ENOENT;
+			return -1;
+		}
+		strcpy(p->name, prop_names[p->prop_id - PROP_CONNECTOR_CRTC_ID]);
+		p->count_values = 0;
+		p->count_enum_blobs = 0;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_CREATEPROPBLOB: {
+		struct drm_mode_create_blob *blob = arg;
+
+		if (blob->length != sizeof(struct drm_mode_modeinfo))
+			REFUSE("mode blob of %u bytes", blob->length);
+		blob->blob_id = 200 + dev.nr_blobs++;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_DESTROYPROPBLOB: {
+		struct drm_mode_destroy_blob *blob = arg;
+
+		if (blob->blob_id < 200 || dev.nr_blobs == 0)
+			REFUSE("no blob %u", blob->blob_id);
+		dev.nr_blobs--;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_CREATE_DUMB: {
+		struct drm_mode_create_dumb *create = arg;
+
+		if (dev.handle)
+			REFUSE("a second dumb buffer");
+		if (create->bpp != 32 || !create->width || !create->height)
+			REFUSE("dumb buffer %ux%u at %u bpp", create->width,
+			       create->height, create->bpp);
+		/* padded rows, like some drivers have them */
+		dev.pitch = (create->width * 4 + 63) & ~63u;
+		dev.size = (uint64_t)dev.pitch * create->height;
+		dev.mem = calloc(1, dev.size);
+		if (!dev.mem) {
+			errno = ENOMEM;
+			return -1;
+		}
+		create->pitch = dev.pitch;
+		create->size = dev.size;
+		create->handle = dev.handle = 5;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_MAP_DUMB: {
+		struct drm_mode_map_dumb *map = arg;
+
+		if (map->handle != dev.handle)
+			REFUSE("map of dumb buffer %u", map->handle);
+		map->offset = MAP_OFFSET;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_DESTROY_DUMB: {
+		struct drm_mode_destroy_dumb *destroy = arg;
+
+		if (destroy->handle != dev.handle)
+			REFUSE("destroy of dumb buffer %u", destroy->handle);
+		free(dev.mem);
+		dev.mem = NULL;
+		dev.handle = 0;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_ADDFB2: {
+		struct drm_mode_fb_cmd2 *fb = arg;
+		int i;
+
+		if (fb->handles[0] != dev.handle ||
+		    fb->pixel_format != DRM_FORMAT_XRGB8888 ||
+		    fb->pitches[0] != dev.pitch ||
+		    fb->offsets[0] + (uint64_t)fb->pitches[0] * fb->height >
+		    dev.size)
+			REFUSE("framebuffer outside the dumb buffer");
+		for (i = 0; i < NR_FBS && dev.fbs[i].used; i++)
+			;
+		if (i == NR_FBS)
+			REFUSE("too many framebuffers");
+		dev.fbs[i].used = 1;
+		dev.fbs[i].id = 50 + i;
+		dev.fbs[i].offset = fb->offsets[0];
+		fb->fb_id = dev.fbs[i].id;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_RMFB: {
+		uint32_t *id = arg;
+		int i;
+
+		for (i = 0; i < NR_FBS; i++)
+			if (dev.fbs[i].used && dev.fbs[i].id == *id)
+				break;
+		if (i == NR_FBS)
+			REFUSE("no framebuffer %u to remove", *id);
+		/* the kernel would turn the CRTC off */
+		if (dev.shown_fb == *id)
+			REFUSE("removing framebuffer %u while on screen", *id);
+		dev.fbs[i].used = 0;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_SETCRTC: {
+		struct drm_mode_crtc *crtc = arg;
+
+		if (crtc->crtc_id != CRTC)
+			REFUSE("no CRTC %u", crtc->crtc_id);
+		if (dev.flip_pending)
+			REFUSE("SETCRTC during a page flip");
+		if (crtc->fb_id == 0) {
+			if (crtc->count_connectors || crtc->mode_valid)
+				REFUSE("CRTC off, but with a mode");
+			dev.active = 0;
+			dev.shown_fb = 0;
+			return 0;
+		}
+		if (!fb_exists(crtc->fb_id) || !crtc->mode_valid ||
+		    crtc->count_connectors != 1 ||
+		    *(uint32_t *)(uintptr_t)crtc->set_connectors_ptr != CONNECTOR)
+			REFUSE("SETCRTC with framebuffer %u", crtc->fb_id);
+		dev.active = 1;
+		dev.shown_fb = crtc->fb_id;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_PAGE_FLIP: {
+		struct drm_mode_crtc_page_flip *flip = arg;
+
+		if (flip->crtc_id != CRTC || !fb_exists(flip->fb_id))
+			REFUSE("page flip to framebuffer %u", flip->fb_id);
+		if (!dev.active)
+			REFUSE("page flip on a CRTC that is off");
+		if (!(flip->flags & DRM_MODE_PAGE_FLIP_EVENT))
+			REFUSE("page flip without event");
+		if (dev.flip_pending) {
+			errno = EBUSY;
+			return -1;
+		}
+		dev.shown_fb = flip->fb_id;
+		dev.flip_pending = 1;
+		dev.nr_flips++;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_ATOMIC:
+		return device_atomic(arg);
+	}
+
+	REFUSE("unknown ioctl %lx", request);
+}
+
+int __real_open(const char *path, int flags, ...);
+int __real_close(int fd);
+int __real_ioctl(int fd, unsigned long request, void *arg);
+void *__real_mmap(void *addr, size_t len, int prot, int flags, int fd,
+		  off_t offset);
+int __real_munmap(void *addr, size_t len);
+ssize_t __real_read(int fd, void *buf, size_t len);
+
+int __wrap_open(const char *path, int flags, ...)
+{
+	va_list ap;
+	int mode;
+
+	if (strcmp(path, DEVICE) == 0)
+		return DEVICE_FD;
+
+	va_start(ap, flags);
+	mode = va_arg(ap, int);
+	va_end(ap);
+
+	return __real_open(path, flags, mode);
+}
+
+int __wrap_close(int fd)
+{
+	return fd == DEVICE_FD ? 0 : __real_close(fd);
+}
+
+int __wrap_ioctl(int fd, unsigned long request, void *arg)
+{
+	return fd == DEVICE_FD ? device_ioctl(request, arg) :
+				 __real_ioctl(fd, request, arg);
+}
+
+void *__wrap_mmap(void *addr, size_t len, int prot, int flags, int fd,
+		  off_t offset)
+{
+	if (fd != DEVICE_FD)
+		return __real_mmap(addr, len, prot, flags, fd, offset);
+
+	if (offset != MAP_OFFSET || len > dev.size) {
+		fprintf(stderr, "device: mmap of %zu bytes at %lx\n", len,
+			(unsigned long)offset);
+		dev.errors++;
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	return dev.mem;
+}
+
+int __wrap_munmap(void *addr, size_t len)
+{
+	return addr == dev.mem ? 0 : __real_munmap(addr, len);
+}
+
+/* the flip completes right away */
+ssize_t __wrap_read(int fd, void *buf, size_t len)
+{
+	struct drm_event_vblank e;
+
+	if (fd != DEVICE_FD)
+		return __real_read(fd, buf, len);
+
+	if (!dev.flip_pending) {
+		fprintf(stderr, "device: read with no event to come\n");
+		dev.errors++;
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len < sizeof(e)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.base.type = DRM_EVENT_FLIP_COMPLETE;
+	e.base.length = sizeof(e);
+	memcpy(buf, &e, sizeof(e));
+	dev.flip_pending = 0;
+
+	return sizeof(e);
+}
+
+/* read() as _FORTIFY_SOURCE has it */
+ssize_t __wrap___read_chk(int fd, void *buf, size_t len, size_t size)
+{
+	(void)size;
+	return __wrap_read(fd, buf, len);
+}
+
+/* pixel (x, y) of the framebuffer on screen, ~0 if it isn't ours */
+static uint32_t shown_pixel(int x, int y)
+{
+	uint32_t v;
+	int i;
+
+	for (i = 0; i < NR_FBS; i++) {
+		if (dev.fbs[i].used && dev.fbs[i].id == dev.shown_fb) {
+			memcpy(&v, dev.mem + dev.fbs[i].offset +
+			       y * dev.pitch + x * 4, 4);
+			return v & 0xffffff;
+		}
+	}
+	return ~0;
+}
+
+#define NR_FRAMES	20
+
+/* 0 if drawing and closing went as they should on device type */
+static int check(int type)
+{
+	int i, failed = 0, fbs = 0;
+	uint32_t v;
+
+	device_reset(type);
+	if (open_framebuffer() < 0) {
+		printf("can't open\n");
+		return 1;
+	}
+	if (xres != 640 || yres != 480) {
+		printf("%ux%u, not the preferred 640x480\n", xres, yres);
+		failed = 1;
+	}
+	if (framebuffer_vsync() != double_buffer) {
+		printf("vsync %d\n", framebuffer_vsync());
+		failed = 1;
+	}
+
+	setcolor(1, 0xff0000);
+	setcolor(2, 0x00ff00);
+	for (i = 0; i < NR_FRAMES; i++) {
+		fillrect(0, 0, xres - 1, yres - 1, 0);
+		fillrect(10 + i * 5, 10, 60 + i * 5, 60, 1 + (i & 1));
+		flush_framebuffer();
+	}
+
+	/* the last frame has color 2 from x 105 to 155 */
+	v = shown_pixel(120, 30);
+	if (v != 0x00ff00) {
+		printf("%06x on screen, not the last frame\n", v);
+		failed = 1;
+	}
+	v = shown_pixel(60, 30);
+	if (v != 0) {
+		printf("%06x on screen, left of the last frame\n", v);
+		failed = 1;
+	}
+	if (dev.nr_flips != (double_buffer ? NR_FRAMES : 0)) {
+		printf("%d page flips\n", dev.nr_flips);
+		failed = 1;
+	}
+	if ((dev.nr_commits > 0) != (type == DEVICE_ATOMIC)) {
+		printf("%d atomic commits\n", dev.nr_commits);
+		failed = 1;
+	}
+
+	close_framebuffer();
+
+	for (i = 0; i < NR_FBS; i++)
+		fbs += dev.fbs[i].used;
+	if (dev.shown_fb != FBCON_FB || !dev.active || dev.flip_pending ||
+	    fbs || dev.nr_blobs || dev.handle) {
+		printf("after closing: framebuffer %u on screen, active %d, flip pending %d, %d framebuffers, %u blobs, dumb buffer %u left\n",
+		       dev.shown_fb, dev.active, dev.flip_pending, fbs,
+		       dev.nr_blobs, dev.handle);
+		failed = 1;
+	}
+
+	return failed || dev.errors;
+}
+
+int main(void)
+{
+	int type, failed = 0, ret;
+
+	setenv("LC_DRMDEVICE", DEVICE, 1);
+	shadow_buffer = 1;
+	for (double_buffer = 0; double_buffer < 2; double_buffer++) {
+		for (type = 0; type < NR_DEVICES; type++) {
+			ret = check(type);
+			printf("%s, double buffer %d: %s\n", device_names[type],
+			       double_buffer, ret ? "FAIL" : "ok");
+			failed += ret;
+		}
+	}
+
+	return failed != 0;
+}
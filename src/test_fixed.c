@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * "make check": the Q16.16 solver and transform against the float ones,
+ * which are what perform_calibration() gives without --enable-fixed-point,
+ * over made up sessions on a few screen sizes. Fails if a session doesn't
+ * solve or a point lands more than MAX_ERROR pixels off in x or y.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "lc.h"
+
+#define NR_SESSIONS	1024
+#define MAX_ERROR	1
+
+static const int sizes[][2] = {
+	{ 320, 240 }, { 800, 480 }, { 1920, 1080 }, { 3840, 2160 },
+};
+
+/* a panel with random gain, offset and orientation, like lc_bench's */
+static void fake_session(calibration *cal, int xres, int yres)
+{
+	const int fbx[NUM_POINTS] = { xres / 8, xres - xres / 8 - 1,
+				      xres - xres / 8 - 1, xres / 8 };
+	const int fby[NUM_POINTS] = { yres / 8, yres / 8,
+				      yres - yres / 8 - 1, yres - yres / 8 - 1 };
+	double gx = 2 + rand() % 3000 / 100.0;
+	double gy = 2 + rand() % 3000 / 100.0;
+	int ox = rand() % 500, oy = rand() % 500;
+	int orientation = rand() % 8;
+	int i, x, y, tmp;
+
+	/* the panel's 15 bits must cover the screen */
+	if (gx * xres + ox > 32000)
+		gx = (32000.0 - ox) / xres;
+	if (gy * yres + oy > 32000)
+		gy = (32000.0 - oy) / yres;
+
+	memset(cal, 0, sizeof(*cal));
+	for (i = 0; i < NUM_POINTS; i++) {
+		x = ox + fbx[i] * gx + rand() % 5;
+		y = oy + fby[i] * gy + rand() % 5;
+		if (orientation & ORIENT_INVERT_X)
+			x = 32767 - x;
+		if (orientation & ORIENT_INVERT_Y)
+			y = 32767 - y;
+		if (orientation & ORIENT_SWAP_XY) {
+			tmp = x; x = y; y = tmp;
+		}
+		cal->x[i] = x;
+		cal->y[i] = y;
+		cal->xfb[i] = fbx[i];
+		cal->yfb[i] = fby[i];
+	}
+	cal->orientation = detect_orientation(cal);
+}
+
+static int round_px(float v)
+{
+	return (int)(v + (v < 0 ? -0.5f : 0.5f));
+}
+
+int main(void)
+{
+	calibration cal;
+	int a[7], in[2], out[2], ex, ey, max_err = 0;
+	float m[6], ref[2], pin[2];
+	unsigned int s;
+	int i, x, y, failed = 0;
+
+	srand(1);
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (i = 0; i < NR_SESSIONS; i++) {
+			fake_session(&cal, sizes[s][0], sizes[s][1]);
+			if (!calibrate_float(&cal)) {
+				failed++;
+				continue;
+			}
+			memcpy(a, cal.a, sizeof(a));
+#ifndef LC_FIXED_POINT
+			/* the reference is what a calibration run ends with */
+			if (i == 0 && (!perform_calibration(&cal) ||
+				       memcmp(a, cal.a, sizeof(a)) != 0)) {
+				printf("perform_calibration() isn't the reference\n");
+				failed++;
+			}
+#endif
+			if (!calibrate_fixed(&cal)) {
+				failed++;
+				continue;
+			}
+
+			calibration_to_matrix(a, m);
+			for (y = 0; y < 32768; y += 1024) {
+				for (x = 0; x < 32768; x += 1024) {
+					in[0] = x;
+					in[1] = y;
+					pin[0] = x;
+					pin[1] = y;
+					transform_points_fixed(cal.a, in, out, 1);
+					transform_points(m, pin, ref, 1);
+					ex = abs(out[0] - round_px(ref[0]));
+					ey = abs(out[1] - round_px(ref[1]));
+					if (ex > max_err)
+						max_err = ex;
+					if (ey > max_err)
+						max_err = ey;
+				}
+			}
+		}
+	}
+
+	printf("fixed point: %d sessions failed, %d pixels off at most\n",
+	       failed, max_err);
+
+	return failed || max_err > MAX_ERROR;
+}
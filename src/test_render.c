@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * "make check": draws a scene into memory framebuffers of every format and
+ * rotation, drawing directly, through the shadow buffer and double
+ * buffered, and compares what dump_framebuffer() gives with
+ * test_render.ppm, the scene at rotation 0 in XRGB8888. Other rotations
+ * are compared with it turned the way the screen is, formats with fewer
+ * bits with its colors cut down the same way. A picture that set_rotation()
+ * turns must stay where it is on screen. "test_render <file>" writes the
+ * scene to file instead, to make a new test_render.ppm after changing it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "fbutils.h"
+
+#define WIDTH	320
+#define HEIGHT	240
+/* the scene fits in a square, to fit every rotation */
+#define SCENE	240
+
+/* Index 1, 2 and 4 are free, the rest their exclusive-or, so that drawing
+ * in XORMODE gives the same colors with a palette as without one.
+ */
+static const unsigned int palette[] = {
+	0x000000, 0xffe080, 0x3070ff, 0xcf907f,
+	0xe0c0a0, 0x1f2020, 0xd0b05f, 0x2f50df,
+};
+#define NR_COLORS (sizeof(palette) / sizeof(palette[0]))
+
+/* bits of red, green and blue */
+static const struct {
+	const char *name;
+	unsigned int bits[3];
+} formats[] = {
+	{ "C8",       { 8, 8, 8 } },
+	{ "RGB332",   { 3, 3, 2 } },
+	{ "XRGB1555", { 5, 5, 5 } },
+	{ "ARGB1555", { 5, 5, 5 } },
+	{ "RGB565",   { 5, 6, 5 } },
+	{ "BGR565",   { 5, 6, 5 } },
+	{ "RGB888",   { 8, 8, 8 } },
+	{ "BGR888",   { 8, 8, 8 } },
+	{ "XRGB8888", { 8, 8, 8 } },
+	{ "ARGB8888", { 8, 8, 8 } },
+	{ "XBGR8888", { 8, 8, 8 } },
+	{ "ABGR8888", { 8, 8, 8 } },
+	{ "RGBA8888", { 8, 8, 8 } },
+	{ "BGRA8888", { 8, 8, 8 } },
+};
+#define NR_FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+static unsigned char *golden;
+
+static void draw_scene(void)
+{
+	int i;
+
+	fillrect(0, 0, xres - 1, yres - 1, 0);
+	fillrect(20, 20, 110, 90, 4);
+	rect(10, 10, 120, 100, 2);
+	for (i = 0; i < 8; i++)
+		line(130, 10, 230 - i * 12, 100 + i * 10, 1 + (i & 1));
+	put_string(10, 120, "libinput_calibrator", 1);
+	put_cross(60, 180, 1);
+	put_cross(180, 180, 2 | XORMODE);
+	fillrect(150, 150, 220, 220, 4 | XORMODE);
+	for (i = 0; i < SCENE; i += 4)
+		pixel(i, SCENE - 1, 2);
+}
+
+/* where a pixel of the screen is in the picture drawn with rotation r */
+static void logical(int r, int px, int py, int *x, int *y)
+{
+	switch (r) {
+	case 0:
+		*x = px;
+		*y = py;
+		break;
+	case 1:
+		*x = py;
+		*y = WIDTH - 1 - px;
+		break;
+	case 2:
+		*x = WIDTH - 1 - px;
+		*y = HEIGHT - 1 - py;
+		break;
+	case 3:
+		*x = HEIGHT - 1 - py;
+		*y = px;
+		break;
+	}
+}
+
+/* an 8 bit component through a format with fewer bits and back */
+static unsigned char cut(unsigned char c, unsigned int bits)
+{
+	unsigned int max = (1 << bits) - 1;
+
+	return (c >> (8 - bits)) * 255 / max;
+}
+
+/* The scene, drawn at rotation r, on screen at (px, py), in the colors
+ * of format f. What set_rotation() turned to r from the rotation it was
+ * drawn at comes with a square in color 5 at (0, 0) of r.
+ */
+static void expected(unsigned int f, int drawn, int r, int px, int py,
+		     unsigned char *rgb)
+{
+	const unsigned char *g;
+	int x, y, i;
+
+	logical(r, px, py, &x, &y);
+	if (drawn != r && x < 16 && y < 16) {
+		for (i = 0; i < 3; i++)
+			rgb[i] = cut(palette[5] >> (16 - 8 * i), formats[f].bits[i]);
+		return;
+	}
+
+	logical(drawn, px, py, &x, &y);
+	if (x >= WIDTH || y >= HEIGHT) {
+		memset(rgb, 0, 3);
+		return;
+	}
+	g = golden + (y * WIDTH + x) * 3;
+	for (i = 0; i < 3; i++)
+		rgb[i] = cut(g[i], formats[f].bits[i]);
+}
+
+/* the pixels of a PPM of the screen, NULL if it isn't one */
+static unsigned char *read_ppm(const char *path)
+{
+	unsigned char *buf;
+	unsigned int w, h;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	if (fscanf(f, "P6 %u %u 255", &w, &h) != 2 || fgetc(f) != '\n' ||
+	    w != WIDTH || h != HEIGHT) {
+		fprintf(stderr, "%s: not a %ux%u PPM\n", path, WIDTH, HEIGHT);
+		fclose(f);
+		return NULL;
+	}
+	buf = malloc(WIDTH * HEIGHT * 3);
+	if (buf && fread(buf, 3, WIDTH * HEIGHT, f) != WIDTH * HEIGHT) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+
+	return buf;
+}
+
+/* Draws the scene in format f at rotation drawn, turns it to rotation r
+ * and compares the screen with what it should show, 0 if they match.
+ */
+static int check(unsigned int f, int drawn, int r)
+{
+	char out[] = "test_render-XXXXXX";
+	unsigned char *buf, rgb[3];
+	int fd, x, y, ret = 1;
+
+	fd = mkstemp(out);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	rotation = drawn;
+	if (open_framebuffer_memory_format(WIDTH, HEIGHT,
+					   formats[f].name) < 0)
+		goto out;
+	setpalette(0, NR_COLORS, palette);
+	draw_scene();
+	if (r != drawn) {
+		set_rotation(r);
+		fillrect(0, 0, 15, 15, 5);
+	}
+	flush_framebuffer();
+	if (dump_framebuffer(out) < 0) {
+		close_framebuffer();
+		goto out;
+	}
+	close_framebuffer();
+
+	buf = read_ppm(out);
+	if (!buf)
+		goto out;
+	ret = 0;
+	for (y = 0; y < HEIGHT && !ret; y++) {
+		for (x = 0; x < WIDTH; x++) {
+			expected(f, drawn, r, x, y, rgb);
+			if (memcmp(buf + (y * WIDTH + x) * 3, rgb, 3) != 0) {
+				printf("(%d, %d) is %02x%02x%02x, not %02x%02x%02x\n",
+				       x, y, buf[(y * WIDTH + x) * 3],
+				       buf[(y * WIDTH + x) * 3 + 1],
+				       buf[(y * WIDTH + x) * 3 + 2],
+				       rgb[0], rgb[1], rgb[2]);
+				ret = 1;
+				break;
+			}
+		}
+	}
+	free(buf);
+out:
+	unlink(out);
+	printf("%-8s shadow %d double %d rotation %d", formats[f].name,
+	       shadow_buffer, double_buffer, drawn);
+	if (r != drawn)
+		printf(" turned to %d", r);
+	printf(": %s\n", ret ? "FAIL" : "ok");
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *srcdir = getenv("srcdir");
+	char path[4096];
+	unsigned int f, mode;
+	int r, to, failed = 0;
+
+	if (argc > 1) {
+		if (open_framebuffer_memory_format(WIDTH, HEIGHT, "XRGB8888") < 0)
+			return 1;
+		setpalette(0, NR_COLORS, palette);
+		draw_scene();
+		flush_framebuffer();
+		failed = dump_framebuffer(argv[1]) < 0;
+		close_framebuffer();
+		return failed;
+	}
+
+	snprintf(path, sizeof(path), "%s/test_render.ppm",
+		 srcdir ? srcdir : ".");
+	golden = read_ppm(path);
+	if (!golden)
+		return 1;
+
+	/* direct, shadow buffer, shadow buffer and two pages */
+	for (mode = 0; mode < 3; mode++) {
+		shadow_buffer = mode > 0;
+		double_buffer = mode > 1;
+		for (f = 0; f < NR_FORMATS; f++) {
+			for (r = 0; r < 4; r++) {
+				failed += check(f, r, r);
+				/* only the shadow buffer keeps the picture */
+				for (to = 0; to < 4 && shadow_buffer; to++)
+					if (to != r)
+						failed += check(f, r, to);
+			}
+		}
+	}
+	free(golden);
+
+	return failed != 0;
+}
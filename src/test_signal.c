@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2024 Martin Kepplinger-Novaković
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ *
+ * "make check": SIGTERM while the cross glides, drawn by 4 threads. Only
+ * the main thread may take it, the render thread and the workers it waits
+ * for have to block it, and libinput_calibrator has to leave with 1.
+ * SIGTERM comes while the main thread blocks it, so that the kernel hands
+ * it to any other thread that doesn't. A deadlock in there ends in SIGALRM.
+ */
+#define main lc_main
+#include "lc.c"
+#undef main
+
+#include <dirent.h>
+#include <sys/wait.h>
+
+/* 0 if every thread but this one blocks signo */
+static int others_block(int signo)
+{
+	unsigned long long blocked;
+	char path[64], line[128];
+	struct dirent *d;
+	int found, ret = 0;
+	DIR *dir;
+	FILE *f;
+
+	dir = opendir("/proc/self/task");
+	if (!dir) {
+		perror("/proc/self/task");
+		return 1;
+	}
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.' || atoi(d->d_name) == getpid())
+			continue;
+		snprintf(path, sizeof(path), "/proc/self/task/%s/status",
+			 d->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		found = 0;
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "SigBlk: %llx", &blocked) == 1)
+				found = 1;
+		fclose(f);
+		if (!found || !(blocked & (1ULL << (signo - 1)))) {
+			printf("thread %s takes signal %d\n", d->d_name, signo);
+			ret = 1;
+		}
+	}
+	closedir(dir);
+
+	return ret;
+}
+
+static void glide(void)
+{
+	sigset_t term;
+
+	render_threads = 4;
+	shadow_buffer = 1;
+	double_buffer = 1;
+	if (open_framebuffer_memory(1920, 1080, 32) < 0)
+		exit(2);
+	signal(SIGTERM, sig);
+	render_start();
+	if (!render.running || others_block(SIGTERM))
+		exit(2);
+
+	render_push(RENDER_CROSS, 100, 100, 1800, 1000);
+	usleep(GLIDE_MS * 1000 / 3);
+
+	sigemptyset(&term);
+	sigaddset(&term, SIGTERM);
+	sigprocmask(SIG_BLOCK, &term, NULL);
+	kill(getpid(), SIGTERM);
+	usleep(GLIDE_MS * 1000 / 3);
+	sigprocmask(SIG_UNBLOCK, &term, NULL);
+
+	/* sig() should have ended it */
+	exit(3);
+}
+
+int main(void)
+{
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		alarm(10);
+		glide();
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		return 1;
+	}
+	if (WIFSIGNALED(status)) {
+		printf("killed by signal %d%s\n", WTERMSIG(status),
+		       WTERMSIG(status) == SIGALRM ? ", stuck" : "");
+		return 1;
+	}
+	if (WEXITSTATUS(status) != 1) {
+		printf("exit status %d, not 1\n", WEXITSTATUS(status));
+		return 1;
+	}
+	printf("ok\n");
+
+	return 0;
+}